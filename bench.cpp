@@ -0,0 +1,1188 @@
+#include "bimap.h"
+
+#include "benchmark/benchmark.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct pod64 {
+    std::array<uint64_t, 8> words;
+
+    friend bool operator<(pod64 const &a, pod64 const &b) {
+        return a.words < b.words;
+    }
+    friend bool operator==(pod64 const &a, pod64 const &b) {
+        return a.words == b.words;
+    }
+};
+
+static_assert(sizeof(pod64) == 64);
+
+template <typename K>
+K make_key(uint64_t x);
+
+template <>
+int make_key<int>(uint64_t x) {
+    return static_cast<int>(static_cast<uint32_t>(x));
+}
+
+template <>
+std::string make_key<std::string>(uint64_t x) {
+    // Zero padded so that lexicographic order matches numeric order, and long
+    // enough to defeat the small string optimization.
+    std::string res(20, '0');
+    for (size_t i = res.size(); x != 0; x /= 10) {
+        res[--i] = static_cast<char>('0' + x % 10);
+    }
+    return res;
+}
+
+template <>
+pod64 make_key<pod64>(uint64_t x) {
+    pod64 res{};
+    for (size_t i = 0; i < res.words.size(); i++) {
+        res.words[i] = x + i * 0x9E3779B97F4A7C15ull;
+    }
+    return res;
+}
+
+template <typename K>
+char const *key_name();
+template <>
+char const *key_name<int>() { return "int"; }
+template <>
+char const *key_name<std::string>() { return "string"; }
+template <>
+char const *key_name<pod64>() { return "pod64"; }
+
+// Element i of every benchmarked bimap is (left_key(i), right_key(i)). The
+// right side is a bijective scramble of i, so both orders differ.
+template <typename K>
+K left_key(uint64_t i) {
+    return make_key<K>(i);
+}
+
+template <typename K>
+K right_key(uint64_t i) {
+    if constexpr (std::is_same_v<K, int>) {
+        return make_key<K>(static_cast<uint32_t>(i) * 0x7F4A7C15u);
+    } else {
+        return make_key<K>(i * 0x9E3779B97F4A7C15ull);
+    }
+}
+
+enum class pattern { sequential, uniform, zipfian };
+
+char const *pattern_name(pattern p) {
+    switch (p) {
+    case pattern::sequential:
+        return "sequential";
+    case pattern::uniform:
+        return "uniform";
+    default:
+        return "zipfian";
+    }
+}
+
+// Gray et al., "Quickly generating billion-record synthetic databases".
+struct zipf_generator {
+    zipf_generator(uint64_t n, double theta = 0.99)
+        : n(n), theta(theta), zetan(zeta(n, theta)),
+          alpha(1.0 / (1.0 - theta)),
+          eta((1.0 - std::pow(2.0 / n, 1.0 - theta)) /
+              (1.0 - zeta(2, theta) / zetan)) {}
+
+    template <typename Gen>
+    uint64_t operator()(Gen &gen) {
+        double u = std::uniform_real_distribution<double>()(gen);
+        double uz = u * zetan;
+        if (uz < 1.0) {
+            return 0;
+        }
+        if (uz < 1.0 + std::pow(0.5, theta)) {
+            return std::min<uint64_t>(1, n - 1);
+        }
+        auto res = static_cast<uint64_t>(
+            n * std::pow(eta * u - eta + 1.0, alpha));
+        return std::min(res, n - 1);
+    }
+
+private:
+    static double zeta(uint64_t n, double theta) {
+        double res = 0;
+        for (uint64_t i = 1; i <= n; i++) {
+            res += 1.0 / std::pow(static_cast<double>(i), theta);
+        }
+        return res;
+    }
+
+    uint64_t n;
+    double theta;
+    double zetan;
+    double alpha;
+    double eta;
+};
+
+static constexpr uint64_t seed = 1488228;
+
+// Stream of m indices in [0, n) following the given access pattern. For
+// uniform streams with m == n the result is a permutation.
+std::vector<uint64_t> index_stream(uint64_t n, uint64_t m, pattern p) {
+    std::vector<uint64_t> res(m);
+    std::mt19937_64 gen(seed);
+    switch (p) {
+    case pattern::sequential:
+        for (uint64_t i = 0; i < m; i++) {
+            res[i] = i % n;
+        }
+        break;
+    case pattern::uniform:
+        if (m == n) {
+            std::iota(res.begin(), res.end(), 0);
+            std::shuffle(res.begin(), res.end(), gen);
+        } else {
+            std::uniform_int_distribution<uint64_t> dist(0, n - 1);
+            for (auto &x : res) {
+                x = dist(gen);
+            }
+        }
+        break;
+    case pattern::zipfian: {
+        zipf_generator dist(n);
+        for (auto &x : res) {
+            x = dist(gen);
+        }
+        break;
+    }
+    }
+    return res;
+}
+
+template <typename K>
+using bench_bimap = bimap<K, K>;
+
+template <typename K>
+std::unique_ptr<bench_bimap<K>> build(uint64_t n) {
+    auto res = std::make_unique<bench_bimap<K>>();
+    for (uint64_t i : index_stream(n, n, pattern::uniform)) {
+        res->insert(left_key<K>(i), right_key<K>(i));
+    }
+    return res;
+}
+
+// Benchmarks are registered size-major, so a single cached instance per key
+// type is enough to avoid rebuilding for every read-only benchmark.
+template <typename K>
+bench_bimap<K> const &prebuilt(uint64_t n) {
+    static std::unique_ptr<bench_bimap<K>> cached;
+    static uint64_t cached_n = 0;
+    if (!cached || cached_n != n) {
+        cached.reset();
+        cached = build<K>(n);
+        cached_n = n;
+    }
+    return *cached;
+}
+
+template <typename K>
+frozen_bimap<K, K> const &prebuilt_frozen(uint64_t n) {
+    static std::unique_ptr<frozen_bimap<K, K>> cached;
+    static uint64_t cached_n = 0;
+    if (!cached || cached_n != n) {
+        cached.reset();
+        cached = std::make_unique<frozen_bimap<K, K>>(prebuilt<K>(n));
+        cached_n = n;
+    }
+    return *cached;
+}
+
+struct left_side {
+    static char const *name() { return "left"; }
+
+    template <typename K>
+    static K key(uint64_t i) {
+        return left_key<K>(i);
+    }
+
+    template <typename B, typename K>
+    static auto find(B const &b, K const &k) {
+        return b.find_left(k);
+    }
+    template <typename B, typename K>
+    static auto lower_bound(B const &b, K const &k) {
+        return b.lower_bound_left(k);
+    }
+    template <typename B, typename K>
+    static auto upper_bound(B const &b, K const &k) {
+        return b.upper_bound_left(k);
+    }
+    template <typename B>
+    static auto begin(B const &b) {
+        return b.begin_left();
+    }
+    template <typename B>
+    static auto end(B const &b) {
+        return b.end_left();
+    }
+    template <typename B, typename K>
+    static bool erase_key(B &b, K const &k) {
+        return b.erase_left(k);
+    }
+    template <typename B, typename It>
+    static auto erase(B &b, It it) {
+        return b.erase_left(it);
+    }
+    template <typename B, typename It>
+    static auto erase(B &b, It first, It last) {
+        return b.erase_left(first, last);
+    }
+};
+
+struct right_side {
+    static char const *name() { return "right"; }
+
+    template <typename K>
+    static K key(uint64_t i) {
+        return right_key<K>(i);
+    }
+
+    template <typename B, typename K>
+    static auto find(B const &b, K const &k) {
+        return b.find_right(k);
+    }
+    template <typename B, typename K>
+    static auto lower_bound(B const &b, K const &k) {
+        return b.lower_bound_right(k);
+    }
+    template <typename B, typename K>
+    static auto upper_bound(B const &b, K const &k) {
+        return b.upper_bound_right(k);
+    }
+    template <typename B>
+    static auto begin(B const &b) {
+        return b.begin_right();
+    }
+    template <typename B>
+    static auto end(B const &b) {
+        return b.end_right();
+    }
+    template <typename B, typename K>
+    static bool erase_key(B &b, K const &k) {
+        return b.erase_right(k);
+    }
+    template <typename B, typename It>
+    static auto erase(B &b, It it) {
+        return b.erase_right(it);
+    }
+    template <typename B, typename It>
+    static auto erase(B &b, It first, It last) {
+        return b.erase_right(first, last);
+    }
+};
+
+static constexpr uint64_t query_count = uint64_t(1) << 16;
+
+template <typename K, typename Side>
+std::vector<K> query_keys(uint64_t n, pattern p, uint64_t m = query_count) {
+    std::vector<K> res;
+    res.reserve(m);
+    for (uint64_t i : index_stream(n, m, p)) {
+        res.push_back(Side::template key<K>(i));
+    }
+    return res;
+}
+
+template <typename K>
+void bm_insert(benchmark::State &state, uint64_t n, pattern p) {
+    auto order = index_stream(n, n, p);
+    std::vector<std::pair<K, K>> pairs;
+    pairs.reserve(n);
+    for (uint64_t i : order) {
+        pairs.emplace_back(left_key<K>(i), right_key<K>(i));
+    }
+    for (auto _ : state) {
+        bench_bimap<K> b;
+        for (auto const &kv : pairs) {
+            b.insert(kv.first, kv.second);
+        }
+        benchmark::DoNotOptimize(b.size());
+        state.PauseTiming();
+        { bench_bimap<K> dead(std::move(b)); }
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+    state.counters["node_bytes"] = sizeof(binode<K, K>);
+}
+
+// Inserts the odd half of [0, n) into a bimap holding the even half.
+template <typename K, bool Batched>
+void bm_insert_batch(benchmark::State &state, uint64_t n) {
+    std::vector<std::pair<K, K>> existing, batch;
+    for (uint64_t i : index_stream(n, n, pattern::uniform)) {
+        (i % 2 ? batch : existing).emplace_back(left_key<K>(i), right_key<K>(i));
+    }
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto b = std::make_unique<bench_bimap<K>>();
+        for (auto const &kv : existing) {
+            b->insert(kv.first, kv.second);
+        }
+        state.ResumeTiming();
+        if constexpr (Batched) {
+            benchmark::DoNotOptimize(b->insert_batch(batch.begin(), batch.end()));
+        } else {
+            for (auto const &kv : batch) {
+                b->insert(kv.first, kv.second);
+            }
+        }
+        state.PauseTiming();
+        b.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * batch.size());
+}
+
+template <typename K>
+void bm_assign(benchmark::State &state, uint64_t n, pattern p) {
+    std::vector<std::pair<K, K>> pairs;
+    pairs.reserve(n);
+    for (uint64_t i : index_stream(n, n, p)) {
+        pairs.emplace_back(left_key<K>(i), right_key<K>(i));
+    }
+    bool sorted = p == pattern::sequential;
+    for (auto _ : state) {
+        bench_bimap<K> b;
+        b.assign(pairs.begin(), pairs.end(), sorted);
+        benchmark::DoNotOptimize(b.size());
+        state.PauseTiming();
+        { bench_bimap<K> dead(std::move(b)); }
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Left keys in increasing order, or with one in 16 of them swapped with a
+// key up to 8 places further on.
+template <typename K>
+std::vector<std::pair<K, K>> sorted_pairs(uint64_t n, bool nearly) {
+    std::vector<std::pair<K, K>> res;
+    res.reserve(n);
+    for (uint64_t i = 0; i < n; i++) {
+        res.emplace_back(left_key<K>(i), right_key<K>(i));
+    }
+    if (nearly) {
+        std::mt19937_64 gen(1488322);
+        for (uint64_t i = 0; i + 8 < n; i++) {
+            if (gen() % 16 == 0) {
+                std::swap(res[i], res[i + 1 + gen() % 8]);
+            }
+        }
+    }
+    return res;
+}
+
+// Inserts with the previous insertion as the hint, against plain inserts.
+template <typename K, bool Hinted>
+void bm_insert_sorted(benchmark::State &state, uint64_t n, bool nearly) {
+    auto pairs = sorted_pairs<K>(n, nearly);
+    for (auto _ : state) {
+        bench_bimap<K> b;
+        auto hint = b.end_left();
+        for (auto const &kv : pairs) {
+            if constexpr (Hinted) {
+                hint = b.insert(hint, kv.first, kv.second);
+            } else {
+                b.insert(kv.first, kv.second);
+            }
+        }
+        benchmark::DoNotOptimize(b.size());
+        state.PauseTiming();
+        { bench_bimap<K> dead(std::move(b)); }
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Looks up every key in nearly sorted order, with the previous result as
+// the hint.
+template <typename K, bool Hinted>
+void bm_find_sorted(benchmark::State &state, uint64_t n) {
+    auto const &b = prebuilt<K>(n);
+    auto pairs = sorted_pairs<K>(n, true);
+    for (auto _ : state) {
+        auto hint = b.end_left();
+        for (auto const &kv : pairs) {
+            if constexpr (Hinted) {
+                hint = b.find_left(hint, kv.first);
+            } else {
+                hint = b.find_left(kv.first);
+            }
+            benchmark::DoNotOptimize(hint);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+enum class window { bound, range, sliding };
+
+// Visits windows of 64 consecutive left keys, each 16 keys after the last:
+// by lower_bound and a key comparison per step, by range_left, or by
+// range_left from the previous window. Without Scan only the ends of each
+// window are found.
+template <typename K, window How, bool Scan>
+void bm_windows(benchmark::State &state, uint64_t n) {
+    auto const &b = prebuilt<K>(n);
+    std::vector<K> bounds;
+    for (uint64_t i = 0; i + 64 < n; i += 16) {
+        bounds.push_back(left_key<K>(i));
+    }
+    for (auto _ : state) {
+        auto near = b.range_left(left_key<K>(0), left_key<K>(0));
+        for (size_t i = 0; i + 4 < bounds.size(); i++) {
+            K const &lo = bounds[i];
+            K const &hi = bounds[i + 4];
+            if constexpr (How == window::bound) {
+                auto it = b.lower_bound_left(lo);
+                if constexpr (Scan) {
+                    for (; it != b.end_left() && *it < hi; ++it) {
+                        benchmark::DoNotOptimize(*it);
+                    }
+                } else {
+                    benchmark::DoNotOptimize(it);
+                    benchmark::DoNotOptimize(b.lower_bound_left(hi));
+                }
+            } else {
+                if constexpr (How == window::range) {
+                    near = b.range_left(lo, hi);
+                } else {
+                    near = b.range_left(near, lo, hi);
+                }
+                if constexpr (Scan) {
+                    for (auto const &key : near) {
+                        benchmark::DoNotOptimize(key);
+                    }
+                } else {
+                    benchmark::DoNotOptimize(near);
+                }
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * (bounds.size() - 4));
+}
+
+template <typename K>
+void bm_from_stream(benchmark::State &state, uint64_t n, pattern p) {
+    std::vector<std::pair<K, K>> pairs;
+    pairs.reserve(n);
+    for (uint64_t i : index_stream(n, n, p)) {
+        pairs.emplace_back(left_key<K>(i), right_key<K>(i));
+    }
+    bool sorted = p == pattern::sequential;
+    for (auto _ : state) {
+        auto b = bench_bimap<K>::from_stream(pairs.begin(), pairs.end(), sorted);
+        benchmark::DoNotOptimize(b.size());
+        state.PauseTiming();
+        { bench_bimap<K> dead(std::move(b)); }
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename K, typename Side, bool Frozen = false>
+void bm_find(benchmark::State &state, uint64_t n, pattern p) {
+    auto const &b = [n]() -> auto const & {
+        if constexpr (Frozen) {
+            return prebuilt_frozen<K>(n);
+        } else {
+            return prebuilt<K>(n);
+        }
+    }();
+    auto keys = query_keys<K, Side>(n, p);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Side::find(b, keys[i++ % query_count]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template <typename K, typename Side>
+void bm_find_unordered(benchmark::State &state, uint64_t n, pattern p) {
+    unordered_bimap<K, K> b;
+    b.reserve(n);
+    for (uint64_t i : index_stream(n, n, pattern::uniform)) {
+        b.insert(left_key<K>(i), right_key<K>(i));
+    }
+    auto keys = query_keys<K, Side>(n, p);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Side::find(b, keys[i++ % query_count]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template <typename K, typename Side>
+void bm_find_compact(benchmark::State &state, uint64_t n, pattern p) {
+    compact_bimap<K, K> b;
+    b.reserve(n);
+    for (uint64_t i : index_stream(n, n, pattern::uniform)) {
+        b.insert(left_key<K>(i), right_key<K>(i));
+    }
+    auto keys = query_keys<K, Side>(n, p);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Side::find(b, keys[i++ % query_count]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Lookup by const char*: a plain comparator materializes a std::string per
+// call, a transparent one compares in place.
+template <typename Comp>
+void bm_find_cstr(benchmark::State &state, uint64_t n, pattern p) {
+    bimap<std::string, int, Comp> b;
+    for (uint64_t i = 0; i < n; i++) {
+        b.insert(left_key<std::string>(i), static_cast<int>(i));
+    }
+    auto keys = query_keys<std::string, left_side>(n, p);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(b.find_left(keys[i++ % query_count].c_str()));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template <typename K, typename Side, bool Upper, bool Frozen = false>
+void bm_bound(benchmark::State &state, uint64_t n, pattern p) {
+    auto const &b = [n]() -> auto const & {
+        if constexpr (Frozen) {
+            return prebuilt_frozen<K>(n);
+        } else {
+            return prebuilt<K>(n);
+        }
+    }();
+    auto keys = query_keys<K, Side>(n, p);
+    size_t i = 0;
+    for (auto _ : state) {
+        if constexpr (Upper) {
+            benchmark::DoNotOptimize(
+                Side::upper_bound(b, keys[i++ % query_count]));
+        } else {
+            benchmark::DoNotOptimize(
+                Side::lower_bound(b, keys[i++ % query_count]));
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template <typename K, typename Side>
+void bm_erase_key(benchmark::State &state, uint64_t n, pattern p) {
+    auto keys = query_keys<K, Side>(n, p, std::min(n, query_count));
+    uint64_t erased = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto b = build<K>(n);
+        state.ResumeTiming();
+        for (auto const &k : keys) {
+            erased += Side::erase_key(*b, k);
+        }
+        state.PauseTiming();
+        b.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+    state.counters["erased"] = benchmark::Counter(
+        static_cast<double>(erased), benchmark::Counter::kAvgIterations);
+}
+
+template <typename K, typename Side>
+void bm_erase_iterator(benchmark::State &state, uint64_t n, pattern p) {
+    // Iterators stay valid while other elements are erased, so the lookups
+    // are done up front over the deduplicated query stream.
+    std::vector<K> keys;
+    std::vector<bool> seen(n);
+    for (uint64_t i : index_stream(n, query_count, p)) {
+        if (!seen[i]) {
+            seen[i] = true;
+            keys.push_back(Side::template key<K>(i));
+        }
+    }
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto b = build<K>(n);
+        std::vector<decltype(Side::begin(*b))> its;
+        its.reserve(keys.size());
+        for (auto const &k : keys) {
+            its.push_back(Side::find(*b, k));
+        }
+        state.ResumeTiming();
+        for (auto it : its) {
+            Side::erase(*b, it);
+        }
+        state.PauseTiming();
+        b.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+template <typename K, typename Side>
+void bm_erase_range(benchmark::State &state, uint64_t n, pattern p) {
+    auto keys = query_keys<K, Side>(n, p);
+    uint64_t const width = std::max<uint64_t>(1, n / 1000);
+    uint64_t erased = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto b = build<K>(n);
+        state.ResumeTiming();
+        for (auto const &k : keys) {
+            if (b->size() <= n / 2) {
+                break;
+            }
+            auto first = Side::lower_bound(*b, k);
+            auto last = first;
+            for (uint64_t i = 0; i < width && last != Side::end(*b); i++) {
+                ++last;
+            }
+            erased += b->size();
+            Side::erase(*b, first, last);
+            erased -= b->size();
+        }
+        state.PauseTiming();
+        b.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(erased));
+}
+
+template <typename K, typename Side>
+void bm_iterate(benchmark::State &state, uint64_t n) {
+    auto const &b = prebuilt<K>(n);
+    for (auto _ : state) {
+        for (auto it = Side::begin(b); it != Side::end(b); ++it) {
+            benchmark::DoNotOptimize(*it);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename K>
+void bm_copy(benchmark::State &state, uint64_t n) {
+    auto const &b = prebuilt<K>(n);
+    for (auto _ : state) {
+        auto copy = std::make_unique<bench_bimap<K>>(b);
+        benchmark::DoNotOptimize(copy->size());
+        state.PauseTiming();
+        copy.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename K>
+void bm_equal(benchmark::State &state, uint64_t n) {
+    auto const &b = prebuilt<K>(n);
+    bench_bimap<K> copy(b);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(b == copy);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Compares the prebuilt bimap with a copy that lost, changed and gained 1%
+// of its pairs, either with diff or by probing each side with find_left.
+template <typename K, bool Probe>
+void bm_diff(benchmark::State &state, uint64_t n) {
+    auto const &a = prebuilt<K>(n);
+    bench_bimap<K> b(a);
+    for (uint64_t i = 0; i < n; i += 100) {
+        b.erase_left(left_key<K>(i));
+        b.erase_left(left_key<K>(i + 1));
+        b.insert(left_key<K>(i + 1), right_key<K>(n + i));
+        b.insert(left_key<K>(n + i), right_key<K>(n + i + 1));
+    }
+    for (auto _ : state) {
+        if constexpr (Probe) {
+            uint64_t changes = 0;
+            for (auto it = a.begin_left(); it != a.end_left(); ++it) {
+                auto match = b.find_left(*it);
+                changes += match == b.end_left() || !(*match.flip() == *it.flip());
+            }
+            for (auto it = b.begin_left(); it != b.end_left(); ++it) {
+                changes += a.find_left(*it) == a.end_left();
+            }
+            benchmark::DoNotOptimize(changes);
+        } else {
+            benchmark::DoNotOptimize(diff(a, b));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Cuts the bimap at the left key of rank n * 9 / 10 and glues it back, either
+// with split_left and join or by re-inserting the moved pairs.
+template <typename K, bool Splice>
+void bm_split_join(benchmark::State &state, uint64_t n) {
+    K const key = left_key<K>(n / 10 * 9);
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto b = std::make_unique<bench_bimap<K>>(prebuilt<K>(n));
+        state.ResumeTiming();
+        if constexpr (Splice) {
+            auto upper = b->split_left(key);
+            b->join(std::move(upper));
+        } else {
+            bench_bimap<K> upper;
+            auto first = b->lower_bound_left(key);
+            for (auto it = first; it != b->end_left(); ++it) {
+                upper.insert(*it, *it.flip());
+            }
+            b->erase_left(first, b->end_left());
+            for (auto it = upper.begin_left(); it != upper.end_left(); ++it) {
+                b->insert(*it, *it.flip());
+            }
+        }
+        benchmark::DoNotOptimize(b->size());
+        state.PauseTiming();
+        b.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * (n - n / 10 * 9));
+}
+
+// The baseline for concurrent_bimap: one bimap behind a reader-writer lock.
+template <typename K>
+struct locked_bimap {
+    using bimap_t = bench_bimap<K>;
+
+    std::optional<K> find_left(K const &key) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = b.find_left(key);
+        return it != b.end_left() ? std::optional<K>(*it.flip()) : std::nullopt;
+    }
+
+    void insert(K const &l, K const &r) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        b.insert(l, r);
+    }
+
+    void erase_left(K const &l) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        b.erase_left(l);
+    }
+
+    bench_bimap<K> b;
+    mutable std::shared_mutex mutex;
+};
+
+template <typename Shared>
+Shared &shared_instance(uint64_t n) {
+    using K = typename Shared::bimap_t::left_t;
+    static std::mutex guard;
+    static std::unique_ptr<Shared> cached;
+    static uint64_t cached_n = 0;
+    std::lock_guard<std::mutex> lock(guard);
+    if (!cached || cached_n != n) {
+        cached.reset();
+        cached = std::make_unique<Shared>();
+        for (uint64_t i = 0; i < n; i++) {
+            cached->insert(left_key<K>(i), right_key<K>(i));
+        }
+        cached_n = n;
+    }
+    return *cached;
+}
+
+// Every thread looks up uniform keys; with a writer, thread 0 instead keeps
+// inserting and erasing keys beyond the prebuilt ones.
+template <typename Shared>
+void bm_shared_read(benchmark::State &state, uint64_t n, bool writer) {
+    using K = typename Shared::bimap_t::left_t;
+    Shared &b = shared_instance<Shared>(n);
+    auto keys = query_keys<K, left_side>(n, pattern::uniform, 1 << 12);
+    std::size_t i = static_cast<std::size_t>(state.thread_index()) * 997;
+    uint64_t reads = 0;
+    for (auto _ : state) {
+        if (writer && state.thread_index() == 0) {
+            uint64_t key = n + i++ % 1024;
+            b.insert(left_key<K>(key), right_key<K>(key));
+            b.erase_left(left_key<K>(key));
+        } else {
+            benchmark::DoNotOptimize(b.find_left(keys[i++ % keys.size()]));
+            reads++;
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(reads));
+}
+
+// Every step makes a new version with one pair replaced and keeps the last
+// 32 versions alive, either as persistent_bimap snapshots or as deep copies.
+template <typename K, bool Persistent>
+void bm_versions(benchmark::State &state, uint64_t n) {
+    using version_t =
+        std::conditional_t<Persistent, persistent_bimap<K, K>, bench_bimap<K>>;
+    version_t first;
+    for (uint64_t i : index_stream(n, n, pattern::uniform)) {
+        if constexpr (Persistent) {
+            first = first.insert(left_key<K>(i), right_key<K>(i));
+        } else {
+            first.insert(left_key<K>(i), right_key<K>(i));
+        }
+    }
+    std::vector<version_t> versions(32, first);
+    auto order = index_stream(n, 1 << 12, pattern::uniform);
+    uint64_t step = 0;
+    for (auto _ : state) {
+        uint64_t i = order[step % order.size()];
+        version_t &slot = versions[step % versions.size()];
+        version_t const &last = versions[(step + versions.size() - 1) % versions.size()];
+        K left = left_key<K>(i);
+        K right = right_key<K>(i + (step / order.size() + 1) * n);
+        if constexpr (Persistent) {
+            slot = last.erase_left(left).insert(left, right);
+        } else {
+            slot = last;
+            slot.erase_left(left);
+            slot.insert(left, right);
+        }
+        step++;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+enum class reload { insert, load, map };
+
+// Time to get a queryable map of n pairs back after a restart: inserting
+// them again, load from a saved file, or mapping the file and touching one
+// key.
+template <typename K, reload How>
+void bm_reload(benchmark::State &state, uint64_t n) {
+    std::vector<std::pair<K, K>> pairs;
+    pairs.reserve(n);
+    for (uint64_t i : index_stream(n, n, pattern::uniform)) {
+        pairs.emplace_back(left_key<K>(i), right_key<K>(i));
+    }
+    std::string path = "bimap_bench_reload.bin";
+    prebuilt<K>(n).save(path);
+    for (auto _ : state) {
+        if constexpr (How == reload::insert) {
+            bench_bimap<K> b;
+            for (auto const &p : pairs) {
+                b.insert(p.first, p.second);
+            }
+            benchmark::DoNotOptimize(b.size());
+            state.PauseTiming();
+        } else if constexpr (How == reload::load) {
+            auto b = bench_bimap<K>::load(path);
+            benchmark::DoNotOptimize(b.size());
+            state.PauseTiming();
+        } else {
+            mapped_bimap<K, K> b(path);
+            benchmark::DoNotOptimize(b.find_left(pairs.front().first));
+            state.PauseTiming();
+        }
+        state.ResumeTiming();
+    }
+    std::remove(path.c_str());
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename K>
+using pooled_bimap =
+    bimap<K, K, std::less<K>, std::less<K>, node_pool_allocator<K>>;
+
+// Sliding window: every step erases the oldest element and inserts a new one.
+template <typename B>
+void bm_churn(benchmark::State &state, uint64_t n) {
+    using K = typename B::left_t;
+    B b;
+    for (uint64_t i = 0; i < n; i++) {
+        b.insert(left_key<K>(i), right_key<K>(i));
+    }
+    uint64_t oldest = 0;
+    for (auto _ : state) {
+        b.erase_left(left_key<K>(oldest));
+        b.insert(left_key<K>(oldest + n), right_key<K>(oldest + n));
+        oldest++;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template <typename B>
+void bm_destroy(benchmark::State &state, uint64_t n) {
+    using K = typename B::left_t;
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto b = std::make_unique<B>();
+        for (uint64_t i = 0; i < n; i++) {
+            b->insert(left_key<K>(i), right_key<K>(i));
+        }
+        state.ResumeTiming();
+        b.reset();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename K>
+using counted_bimap =
+    bimap<K, K, std::less<K>, std::less<K>, std::allocator<std::pair<K, K>>,
+          true>;
+
+template <typename B>
+void bm_erase_half(benchmark::State &state, uint64_t n) {
+    using K = typename B::left_t;
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto b = std::make_unique<B>();
+        for (uint64_t i = 0; i < n; i++) {
+            b->insert(left_key<K>(i), right_key<K>(i));
+        }
+        auto first = b->lower_bound_left(left_key<K>(n / 4));
+        auto last = b->lower_bound_left(left_key<K>(n / 4 * 3));
+        state.ResumeTiming();
+        b->erase_left(first, last);
+        benchmark::DoNotOptimize(b->size());
+        state.PauseTiming();
+        b.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * (n / 2));
+}
+
+template <typename K>
+void bm_insert_counted(benchmark::State &state, uint64_t n) {
+    auto order = index_stream(n, n, pattern::uniform);
+    for (auto _ : state) {
+        counted_bimap<K> b;
+        for (uint64_t i : order) {
+            b.insert(left_key<K>(i), right_key<K>(i));
+        }
+        benchmark::DoNotOptimize(b.size());
+        state.PauseTiming();
+        { counted_bimap<K> dead(std::move(b)); }
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+    state.counters["node_bytes"] = sizeof(binode<K, K, true>);
+}
+
+// Page access at a uniformly random offset: nth_left on a counted bimap
+// against walking the iterator from begin.
+template <typename K, bool Counted>
+void bm_nth(benchmark::State &state, uint64_t n) {
+    counted_bimap<K> b;
+    for (uint64_t i = 0; i < n; i++) {
+        b.insert(left_key<K>(i), right_key<K>(i));
+    }
+    auto offsets = index_stream(n, query_count, pattern::uniform);
+    size_t i = 0;
+    for (auto _ : state) {
+        uint64_t k = offsets[i++ % query_count];
+        if constexpr (Counted) {
+            benchmark::DoNotOptimize(b.nth_left(k));
+        } else {
+            auto it = b.begin_left();
+            for (uint64_t j = 0; j < k; j++) {
+                ++it;
+            }
+            benchmark::DoNotOptimize(it);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template <typename F>
+benchmark::internal::Benchmark *add(std::string const &name, F &&f) {
+    return benchmark::RegisterBenchmark(name.c_str(), std::forward<F>(f))
+        ->Unit(benchmark::kMicrosecond);
+}
+
+template <typename K, typename Side>
+void register_side(uint64_t n, pattern p) {
+    std::string suffix = std::string("/") + Side::name() + "/" +
+                         key_name<K>() + "/" + pattern_name(p) + "/" +
+                         std::to_string(n);
+    add("find" + suffix,
+        [=](benchmark::State &s) { bm_find<K, Side>(s, n, p); });
+    add("find/compact" + suffix,
+        [=](benchmark::State &s) { bm_find_compact<K, Side>(s, n, p); });
+    if constexpr (!std::is_same_v<K, pod64>) {
+        add("find/unordered" + suffix, [=](benchmark::State &s) {
+            bm_find_unordered<K, Side>(s, n, p);
+        });
+    }
+    add("lower_bound" + suffix,
+        [=](benchmark::State &s) { bm_bound<K, Side, false>(s, n, p); });
+    add("upper_bound" + suffix,
+        [=](benchmark::State &s) { bm_bound<K, Side, true>(s, n, p); });
+    add("find/frozen" + suffix,
+        [=](benchmark::State &s) { bm_find<K, Side, true>(s, n, p); });
+    add("lower_bound/frozen" + suffix, [=](benchmark::State &s) {
+        bm_bound<K, Side, false, true>(s, n, p);
+    });
+    add("erase_key" + suffix,
+        [=](benchmark::State &s) { bm_erase_key<K, Side>(s, n, p); });
+    add("erase_iterator" + suffix,
+        [=](benchmark::State &s) { bm_erase_iterator<K, Side>(s, n, p); });
+    add("erase_range" + suffix,
+        [=](benchmark::State &s) { bm_erase_range<K, Side>(s, n, p); });
+}
+
+template <typename K>
+void register_all(uint64_t n) {
+    std::string suffix =
+        std::string("/") + key_name<K>() + "/" + std::to_string(n);
+    for (pattern p :
+         {pattern::sequential, pattern::uniform, pattern::zipfian}) {
+        add(std::string("insert/") + key_name<K>() + "/" + pattern_name(p) +
+                "/" + std::to_string(n),
+            [=](benchmark::State &s) { bm_insert<K>(s, n, p); });
+        add(std::string("assign/") + key_name<K>() + "/" + pattern_name(p) +
+                "/" + std::to_string(n),
+            [=](benchmark::State &s) { bm_assign<K>(s, n, p); });
+        add(std::string("from_stream/") + key_name<K>() + "/" +
+                pattern_name(p) + "/" + std::to_string(n),
+            [=](benchmark::State &s) { bm_from_stream<K>(s, n, p); });
+        register_side<K, left_side>(n, p);
+        register_side<K, right_side>(n, p);
+        if constexpr (std::is_same_v<K, std::string>) {
+            std::string name = std::string("/") + pattern_name(p) + "/" +
+                               std::to_string(n);
+            add("find_cstr/plain" + name, [=](benchmark::State &s) {
+                bm_find_cstr<std::less<std::string>>(s, n, p);
+            });
+            add("find_cstr/transparent" + name, [=](benchmark::State &s) {
+                bm_find_cstr<std::less<>>(s, n, p);
+            });
+        }
+    }
+    for (bool nearly : {false, true}) {
+        std::string order = nearly ? "/nearly_sorted" : "/sorted";
+        add("insert_sorted/hinted" + order + suffix, [=](benchmark::State &s) {
+            bm_insert_sorted<K, true>(s, n, nearly);
+        });
+        add("insert_sorted/plain" + order + suffix, [=](benchmark::State &s) {
+            bm_insert_sorted<K, false>(s, n, nearly);
+        });
+    }
+    add("find_sorted/hinted" + suffix,
+        [=](benchmark::State &s) { bm_find_sorted<K, true>(s, n); });
+    add("find_sorted/plain" + suffix,
+        [=](benchmark::State &s) { bm_find_sorted<K, false>(s, n); });
+    add("windows/bound" + suffix, [=](benchmark::State &s) {
+        bm_windows<K, window::bound, true>(s, n);
+    });
+    add("windows/range" + suffix, [=](benchmark::State &s) {
+        bm_windows<K, window::range, true>(s, n);
+    });
+    add("windows/sliding" + suffix, [=](benchmark::State &s) {
+        bm_windows<K, window::sliding, true>(s, n);
+    });
+    add("window_ends/bound" + suffix, [=](benchmark::State &s) {
+        bm_windows<K, window::bound, false>(s, n);
+    });
+    add("window_ends/range" + suffix, [=](benchmark::State &s) {
+        bm_windows<K, window::range, false>(s, n);
+    });
+    add("window_ends/sliding" + suffix, [=](benchmark::State &s) {
+        bm_windows<K, window::sliding, false>(s, n);
+    });
+    add("insert_batch/batched" + suffix,
+        [=](benchmark::State &s) { bm_insert_batch<K, true>(s, n); });
+    add("insert_batch/one_by_one" + suffix,
+        [=](benchmark::State &s) { bm_insert_batch<K, false>(s, n); });
+    add("iterate/left" + suffix,
+        [=](benchmark::State &s) { bm_iterate<K, left_side>(s, n); });
+    add("iterate/right" + suffix,
+        [=](benchmark::State &s) { bm_iterate<K, right_side>(s, n); });
+    add("copy" + suffix, [=](benchmark::State &s) { bm_copy<K>(s, n); });
+    add("equal" + suffix, [=](benchmark::State &s) { bm_equal<K>(s, n); });
+    add("split_join/splice" + suffix,
+        [=](benchmark::State &s) { bm_split_join<K, true>(s, n); });
+    add("split_join/reinsert" + suffix,
+        [=](benchmark::State &s) { bm_split_join<K, false>(s, n); });
+    add("versions/persistent" + suffix,
+        [=](benchmark::State &s) { bm_versions<K, true>(s, n); });
+    if (n <= 100000) {
+        add("versions/deep_copy" + suffix,
+            [=](benchmark::State &s) { bm_versions<K, false>(s, n); });
+    }
+    if constexpr (std::is_trivially_copyable_v<K>) {
+        add("reload/insert" + suffix,
+            [=](benchmark::State &s) { bm_reload<K, reload::insert>(s, n); });
+        add("reload/load" + suffix,
+            [=](benchmark::State &s) { bm_reload<K, reload::load>(s, n); });
+        add("reload/map" + suffix,
+            [=](benchmark::State &s) { bm_reload<K, reload::map>(s, n); });
+    }
+    add("diff/walk" + suffix,
+        [=](benchmark::State &s) { bm_diff<K, false>(s, n); });
+    add("diff/probe" + suffix,
+        [=](benchmark::State &s) { bm_diff<K, true>(s, n); });
+    add("insert_counted" + suffix,
+        [=](benchmark::State &s) { bm_insert_counted<K>(s, n); });
+    add("erase_half" + suffix,
+        [=](benchmark::State &s) { bm_erase_half<bench_bimap<K>>(s, n); });
+    add("erase_half/counted" + suffix,
+        [=](benchmark::State &s) { bm_erase_half<counted_bimap<K>>(s, n); });
+    add("nth/counted" + suffix,
+        [=](benchmark::State &s) { bm_nth<K, true>(s, n); });
+    if (n <= 100000) {
+        add("nth/iterate" + suffix,
+            [=](benchmark::State &s) { bm_nth<K, false>(s, n); });
+    }
+    add("churn/std_allocator" + suffix,
+        [=](benchmark::State &s) { bm_churn<bench_bimap<K>>(s, n); });
+    add("churn/node_pool" + suffix,
+        [=](benchmark::State &s) { bm_churn<pooled_bimap<K>>(s, n); });
+    add("destroy/std_allocator" + suffix,
+        [=](benchmark::State &s) { bm_destroy<bench_bimap<K>>(s, n); });
+    add("destroy/node_pool" + suffix,
+        [=](benchmark::State &s) { bm_destroy<pooled_bimap<K>>(s, n); });
+}
+
+template <typename K>
+void register_concurrent(uint64_t n) {
+    int threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    for (bool writer : {false, true}) {
+        std::string suffix = std::string(writer ? "/writer/" : "/readers/") +
+                             key_name<K>() + "/" + std::to_string(n);
+        add("shared_read/left_right" + suffix,
+            [=](benchmark::State &s) {
+                bm_shared_read<concurrent_bimap<K, K>>(s, n, writer);
+            })
+            ->ThreadRange(1, threads)
+            ->UseRealTime();
+        add("shared_read/shared_mutex" + suffix,
+            [=](benchmark::State &s) {
+                bm_shared_read<locked_bimap<K>>(s, n, writer);
+            })
+            ->ThreadRange(1, threads)
+            ->UseRealTime();
+    }
+}
+
+int main(int argc, char **argv) {
+    for (uint64_t n = 1000; n <= 10000000; n *= 10) {
+        register_all<int>(n);
+        register_all<std::string>(n);
+        register_all<pod64>(n);
+        register_concurrent<int>(n);
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,3 @@
+#!/bin/bash
+
+cmake-build-$1/bimap_bench --benchmark_out=bench_output.txt --benchmark_out_format=json "${@:2}"
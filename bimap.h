@@ -1,32 +1,80 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
 #include <functional>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
 #include <optional>
-#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace {
     struct left_tag;
     struct right_tag;
 
     struct priority {
-        priority() noexcept : x(rnd()) {}
+        priority() noexcept : x(next()) {}
 
         uint32_t get_priority() const noexcept {
             return x;
         }
 
     private:
-        static inline auto rnd = std::mt19937(1488322);
+        // splitmix64 over a per-thread state, so nodes can be created on
+        // several threads at once without sharing a generator.
+        static uint32_t next() noexcept {
+            thread_local uint64_t state = seed();
+            uint64_t z = state += 0x9e3779b97f4a7c15ull;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            return static_cast<uint32_t>((z ^ (z >> 31)) >> 32);
+        }
+
+        static uint64_t seed() noexcept {
+            static std::atomic<uint64_t> threads{0};
+            return 1488322 + threads.fetch_add(1, std::memory_order_relaxed) * 0xd1b54a32d192ed03ull;
+        }
+
         uint32_t x;
     };
 
-    template<typename T, typename Tag>
-    struct node : virtual priority {
+    template<bool Counted>
+    struct subtree_size {};
+
+    template<>
+    struct subtree_size<true> {
+        std::size_t size = 1;
+    };
+
+    template<typename T, typename Tag, bool Counted = false>
+    struct node : subtree_size<Counted> {
         node() : left(nullptr), right(nullptr), p(nullptr), value() {}
 
-        template<typename Y>
-        explicit node(Y val) : left(nullptr), right(nullptr), p(nullptr), value(std::move(val)) {}
+        template<typename... Args>
+        explicit node(std::in_place_t, Args&&... args)
+            : left(nullptr), right(nullptr), p(nullptr), value(std::in_place, std::forward<Args>(args)...) {}
 
         bool has_value() const noexcept {
             return value.has_value();
@@ -40,62 +88,361 @@ namespace {
             value = val;
         };
 
-        node<T, Tag>* left;
-        node<T, Tag>* right;
-        node<T, Tag>* p;
+        node* left;
+        node* right;
+        node* p;
     private:
         std::optional<T> value;
     };
 
-    template<typename Left, typename Right>
-    struct binode : node<Left, left_tag>, node<Right, right_tag> {
+    template<typename Left, typename Right, bool Counted = false>
+    struct binode : priority, node<Left, left_tag, Counted>, node<Right, right_tag, Counted> {
+        static constexpr bool counted = Counted;
+
         binode() = default;
 
         template<typename L, typename R>
-        binode(L l_val, R r_val) : node<Left, left_tag>(std::move(l_val)), node<Right, right_tag>(std::move(r_val)) {}
+        binode(L&& l_val, R&& r_val)
+            : node<Left, left_tag, Counted>(std::in_place, std::forward<L>(l_val)),
+              node<Right, right_tag, Counted>(std::in_place, std::forward<R>(r_val)) {}
+
+        template<typename L, typename R>
+        binode(priority const& prio, L&& l_val, R&& r_val)
+            : priority(prio), node<Left, left_tag, Counted>(std::in_place, std::forward<L>(l_val)),
+              node<Right, right_tag, Counted>(std::in_place, std::forward<R>(r_val)) {}
+    };
+
+    // Open addressing map from the nodes of a bimap to their copies.
+    template<typename Node>
+    struct clone_map {
+        explicit clone_map(std::size_t n) : slots(capacity(n)), mask(slots.size() - 1) {}
+
+        void put(Node const* from, Node* to) noexcept {
+            std::size_t i = hash(from) & mask;
+            while (slots[i].first) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = {from, to};
+        }
+
+        Node* get(Node const* from) const noexcept {
+            std::size_t i = hash(from) & mask;
+            while (slots[i].first != from) {
+                i = (i + 1) & mask;
+            }
+            return slots[i].second;
+        }
+
+        template<typename F>
+        void for_each(F&& f) const {
+            for (auto const& slot : slots) {
+                if (slot.first) {
+                    f(slot.first, slot.second);
+                }
+            }
+        }
+
+    private:
+        static std::size_t capacity(std::size_t n) noexcept {
+            std::size_t res = 2;
+            while (res < 2 * n) {
+                res *= 2;
+            }
+            return res;
+        }
+
+        static std::size_t hash(Node const* ptr) noexcept {
+            auto x = static_cast<uint64_t>(reinterpret_cast<std::uintptr_t>(ptr));
+            x ^= x >> 33;
+            x *= 0xff51afd7ed558ccdull;
+            x ^= x >> 33;
+            return static_cast<std::size_t>(x);
+        }
+
+        std::vector<std::pair<Node const*, Node*>> slots;
+        std::size_t mask;
     };
 
-    template<typename T, typename Tag, typename Comp>
+    template<typename T, typename Tag, typename Comp, typename Owner>
     struct tree {
-        using node_t = node<T, Tag>;
+        using node_t = node<T, Tag, Owner::counted>;
         using ptr_pair = std::pair<node_t*, node_t*>;
 
+        struct position {
+            node_t* parent;
+            bool to_left;
+            bool leftmost;
+            node_t* found;
+        };
+
         tree(node_t* end, Comp comp) noexcept : comp(comp), head(end), begin(end), end(end) {}
 
-        node_t* find(T const& val) const noexcept {
-            node_t* t = head;
-            while (t && (is_valuable(t) || t->left || t->right)) {
-                if (is_valuable(t) && equal(t->get_value(), val)) {
-                    return t;
-                } else if (!is_valuable(t) || comp(val, t->get_value())) {
+        template<typename K>
+        node_t* find(K const& val) const noexcept {
+            return find(val, head);
+        }
+
+        // Searches the subtree of from, which must hold the place of val.
+        template<typename K>
+        node_t* find(K const& val, node_t* from) const noexcept {
+            node_t* t = from;
+            while (t) {
+                if (!is_valuable(t) || comp(val, t->get_value())) {
                     t = t->left;
-                } else {
+                } else if (comp(t->get_value(), val)) {
                     t = t->right;
+                } else {
+                    return t;
                 }
             }
             return nullptr;
         }
 
-        void insert(node_t* new_val) noexcept {
-            if (!is_valuable(begin) || comp(new_val->get_value(), begin->get_value())) {
+        position locate(T const& val) const noexcept {
+            return locate(val, head);
+        }
+
+        // Locates val in the subtree of from, which must hold its place. The
+        // new node is the leftmost one exactly if it hangs left of begin.
+        position locate(T const& val, node_t* from) const noexcept {
+            position res{nullptr, true, true, nullptr};
+            node_t* t = from;
+            while (t) {
+                res.parent = t;
+                if (!is_valuable(t) || comp(val, t->get_value())) {
+                    res.to_left = true;
+                    t = t->left;
+                } else if (comp(t->get_value(), val)) {
+                    res.to_left = false;
+                    t = t->right;
+                } else {
+                    res.found = t;
+                    break;
+                }
+            }
+            res.leftmost = res.to_left && res.parent == begin;
+            return res;
+        }
+
+        // The lowest of hint and its ancestors whose subtree holds the place
+        // of val, reached by climbing parent pointers. A search from there
+        // costs O(log d) expected for a val d positions away from the hint,
+        // rather than O(log n) from the root. The climb compares val only
+        // with the ancestors bounding the subtree so far on its side, and
+        // stops at the first one val is not beyond.
+        template<typename K>
+        node_t* finger(node_t* hint, K const& val) const noexcept {
+            node_t* t = hint;
+            node_t* res = hint;
+            if (!is_valuable(t) || comp(val, t->get_value())) {
+                for (; t->p; t = t->p) {
+                    if (t->p->right == t) {
+                        if (comp(t->p->get_value(), val)) {
+                            return res;
+                        }
+                        if (!comp(val, t->p->get_value())) {
+                            return t->p;
+                        }
+                        res = t->p;
+                    }
+                }
+            } else if (comp(t->get_value(), val)) {
+                for (; t->p; t = t->p) {
+                    if (t->p->left == t) {
+                        if (!is_valuable(t->p) || comp(val, t->p->get_value())) {
+                            return res;
+                        }
+                        if (!comp(t->p->get_value(), val)) {
+                            return t->p;
+                        }
+                        res = t->p;
+                    }
+                }
+            }
+            return res;
+        }
+
+        // Locates many keys at once. A descent is a chain of
+        // dependent cache misses, so they are interleaved a batch at a time to
+        // let the misses of independent descents overlap.
+        std::vector<position> locate_all(std::vector<T const*> const& probes) const {
+            constexpr std::size_t lanes = 16;
+            std::vector<position> res(probes.size(), position{nullptr, true, true, nullptr});
+            for (std::size_t first = 0; first < probes.size(); first += lanes) {
+                std::size_t count = std::min(lanes, probes.size() - first);
+                node_t* cur[lanes];
+                std::fill_n(cur, count, head);
+                for (bool active = true; active;) {
+                    active = false;
+                    for (std::size_t i = 0; i < count; i++) {
+                        node_t* t = cur[i];
+                        if (!t) {
+                            continue;
+                        }
+                        position& pos = res[first + i];
+                        T const& val = *probes[first + i];
+                        pos.parent = t;
+                        if (!is_valuable(t) || comp(val, t->get_value())) {
+                            pos.to_left = true;
+                            t = t->left;
+                        } else if (comp(t->get_value(), val)) {
+                            pos.to_left = false;
+                            pos.leftmost = false;
+                            t = t->right;
+                        } else {
+                            pos.found = t;
+                            t = nullptr;
+                        }
+                        cur[i] = t;
+                        active |= t != nullptr;
+                    }
+                }
+            }
+            return res;
+        }
+
+        void insert(position const& pos, node_t* new_val) noexcept {
+            assert(!pos.found);
+            new_val->p = pos.parent;
+            (pos.to_left ? pos.parent->left : pos.parent->right) = new_val;
+            if (pos.leftmost) {
                 begin = new_val;
             }
-            ptr_pair nodes = split<false>(head, new_val->get_value());
-            nodes.first = merge(nodes.first, new_val);
-            head = merge(nodes.first, nodes.second);
+            update_path(new_val);
+            while (new_val->p && get_priority(new_val) < get_priority(new_val->p)) {
+                rotate_up(new_val);
+            }
+            if (!new_val->p) {
+                head = new_val;
+            }
+        }
+
+        // Builds the tree from nodes in increasing order with distinct keys.
+        // Each node is hung on the right spine as a Cartesian tree by
+        // priority, walking up through parent pointers, so it takes O(n).
+        template<typename It>
+        void build(It first, It last) noexcept {
+            node_t* top = nullptr;
+            node_t* rightmost = nullptr;
+            node_t* smallest = first != last ? *first : nullptr;
+            for (; first != last; ++first) {
+                spine_append(top, rightmost, *first);
+            }
+            adopt_spine(top, rightmost, smallest);
+        }
+
+        // Hangs t, greater than every node so far, on the right spine of a
+        // tree being built outside of any tree object, see build.
+        static void spine_append(node_t*& top, node_t*& rightmost, node_t* t) noexcept {
+            node_t* parent = rightmost;
+            node_t* below = nullptr;
+            while (parent && get_priority(t) < get_priority(parent)) {
+                update(parent);
+                below = parent;
+                parent = parent->p;
+            }
+            t->left = below;
+            t->right = nullptr;
+            t->p = parent;
+            if (below) {
+                below->p = t;
+            }
+            (parent ? parent->right : top) = t;
+            rightmost = t;
+        }
+
+        // Makes an empty tree the one built by spine_append, closed by the
+        // sentinel.
+        void adopt_spine(node_t* top, node_t* rightmost, node_t* smallest) noexcept {
+            assert(empty());
+            spine_append(top, rightmost, end);
+            update_path(rightmost);
+            head = top;
+            begin = smallest ? smallest : end;
+        }
+
+        // Gives this tree the shape of other. Every node of other, including its
+        // sentinel, must have a copy, map returns it, and clone_links must have
+        // been called for each pair.
+        template<typename Map>
+        void clone(tree const& other, Map&& map) noexcept {
+            head = map(other.head);
+            head->p = nullptr;
+            begin = map(other.begin);
+        }
+
+        template<typename Map>
+        static void clone_links(node_t const* from, node_t* to, Map&& map) noexcept {
+            to->left = map(from->left);
+            to->right = map(from->right);
+            ensure_parents(to);
+            if constexpr (Owner::counted) {
+                to->size = from->size;
+            }
         }
 
+        template<bool Update_sizes = true>
         void erase(node_t* elem) noexcept {
             if (begin == elem) {
                 begin = next(begin);
             }
-            ptr_pair nodes1 = split<false>(head, elem->get_value());
-            ptr_pair nodes2 = split<true>(nodes1.second, elem->get_value());
-            head = merge(nodes1.first, nodes2.second);
+            node_t* parent = elem->p;
+            node_t* merged = merge(elem->left, elem->right);
+            if (merged) {
+                merged->p = parent;
+            }
+            if (parent) {
+                (parent->left == elem ? parent->left : parent->right) = merged;
+            } else {
+                head = merged;
+            }
+            if constexpr (Update_sizes) {
+                update_path(parent);
+            }
+        }
+
+        // Detaches an unlinked node for reuse in another tree.
+        static void reset(node_t* t) noexcept {
+            t->left = t->right = t->p = nullptr;
+            update(t);
+        }
+
+        // Recomputes every subtree size bottom-up, for callers that unlinked
+        // many nodes via erase<false>.
+        void recount() noexcept {
+            if constexpr (Owner::counted) {
+                node_t* prev = nullptr;
+                for (node_t* t = head; t;) {
+                    node_t* next;
+                    if (prev == t->p && t->left) {
+                        next = t->left;
+                    } else if (prev != t->right && t->right) {
+                        next = t->right;
+                    } else {
+                        update(t);
+                        next = t->p;
+                    }
+                    prev = t;
+                    t = next;
+                }
+            }
+        }
+
+        static std::size_t index_of(node_t* t) noexcept {
+            std::size_t res = size_of(t->left);
+            for (; t->p; t = t->p) {
+                if (t->p->right == t) {
+                    res += size_of(t->p->left) + 1;
+                }
+            }
+            return res;
         }
 
-        template<typename Delete_type>
-        void erase_range(node_t* first, node_t* last) noexcept {
+        template<typename Deleter>
+        void erase_range(node_t* first, node_t* last, Deleter&& deleter) noexcept {
+            if (first == last) {
+                return;
+            }
             if (begin == first) {
                 begin = last;
             }
@@ -103,15 +450,49 @@ namespace {
             if (last != end) {
                 ptr_pair nodes2 = split<false>(nodes1.second, last->get_value());
                 head = merge(nodes1.first, nodes2.second);
-                destroy<Delete_type>(nodes2.first);
+                destroy(nodes2.first, deleter);
             } else {
-                clear_parents(end);
-                end->left = nullptr;
-                if (end->p) {
-                    (end->p->left == end ? end->p->left : end->p->right) = nullptr;
-                }
+                node_t* erased = without_end(nodes1.second);
                 head = merge(nodes1.first, end);
-                destroy<Delete_type>(nodes1.second);
+                destroy(erased, deleter);
+            }
+        }
+
+        // Cuts off first and the nodes after it and returns them as a treap
+        // without the sentinel. The split follows the path from first up to
+        // the root, so no key is compared.
+        node_t* cut_before(node_t* first) noexcept {
+            ptr_pair parts = split_before(first);
+            node_t* res = without_end(parts.second);
+            head = merge(parts.first, end);
+            if (!parts.first) {
+                begin = end;
+            }
+            return res;
+        }
+
+        // Returns all nodes as a treap without the sentinel and leaves the
+        // tree empty.
+        node_t* release() noexcept {
+            node_t* res = without_end(head);
+            head = begin = end;
+            return res;
+        }
+
+        // Appends a treap whose keys are all greater than the ones in the tree.
+        void append(node_t* t) noexcept {
+            if (t) {
+                head = merge(merge(release(), t), end);
+                begin = leftmost(head);
+            }
+        }
+
+        // Adds a treap whose keys are all absent from the tree.
+        void unite_with(node_t* t) noexcept {
+            if (t) {
+                head = unite(head, t);
+                head->p = nullptr;
+                begin = leftmost(head);
             }
         }
 
@@ -146,23 +527,91 @@ namespace {
         }
 
         void swap(tree& other) noexcept {
+            std::swap(comp, other.comp);
             std::swap(head, other.head);
             std::swap(begin, other.begin);
-            std::swap(end, other.head);
+            std::swap(end, other.end);
+        }
+
+        template<typename K>
+        node_t* lower_bound(K const& val) const {
+            return bound<false>(val);
         }
 
-        node_t* lower_bound(T const& val) const noexcept {
-            return bound<false>(head, val);
+        template<typename K>
+        node_t* upper_bound(K const& val) const {
+            return bound<true>(val);
         }
 
-        node_t* upper_bound(T const& val) const noexcept {
-            return bound<true>(head, val);
+        // Searches the subtree of from, which must hold the place of val, see
+        // finger. If every key there is less than val, the bound is the
+        // ancestor the subtree hangs left of.
+        template<typename K>
+        node_t* lower_bound(K const& val, node_t* from) const noexcept {
+            node_t* t = from;
+            while (t->p && t->p->right == t) {
+                t = t->p;
+            }
+            return bound<false>(val, from, t->p);
+        }
+
+        // lower_bound(lo) and lower_bound(max(lo, hi)) in one descent: the two
+        // searches share their path down to the node that parts them.
+        template<typename K>
+        ptr_pair bounds(K const& lo, K const& hi) const noexcept {
+            if (comp(hi, lo)) {
+                node_t* first = lower_bound(lo);
+                return {first, first};
+            }
+            node_t* first = nullptr;
+            node_t* last = nullptr;
+            for (node_t* t = head; t;) {
+                bool lo_left = !is_valuable(t) || !comp(t->get_value(), lo);
+                bool hi_left = !is_valuable(t) || !comp(t->get_value(), hi);
+                if (lo_left != hi_left) {
+                    return {bound<false>(lo, t->left, t), bound<false>(hi, t->right, last)};
+                }
+                if (lo_left) {
+                    first = last = t;
+                    t = t->left;
+                } else {
+                    t = t->right;
+                }
+            }
+            return {first, last};
         }
 
         bool empty() const noexcept {
             return begin == end;
         }
 
+        node_t* nth(std::size_t k) const noexcept {
+            node_t* t = head;
+            while (k != size_of(t->left)) {
+                if (k < size_of(t->left)) {
+                    t = t->left;
+                } else {
+                    k -= size_of(t->left) + 1;
+                    t = t->right;
+                }
+            }
+            return t;
+        }
+
+        template<typename K>
+        std::size_t rank(K const& val) const noexcept {
+            std::size_t res = 0;
+            for (node_t* t = head; t;) {
+                if (is_valuable(t) && comp(t->get_value(), val)) {
+                    res += size_of(t->left) + 1;
+                    t = t->right;
+                } else {
+                    t = t->left;
+                }
+            }
+            return res;
+        }
+
         node_t* get_begin() const noexcept {
             return begin;
         }
@@ -175,80 +624,261 @@ namespace {
             return !comp(a, b) && !comp(b, a);
         }
 
-        template<typename Delete_type>
-        void destroy() {
-            destroy<Delete_type>(head);
+        template<typename Deleter>
+        void destroy(Deleter&& deleter) {
+            destroy(head, deleter);
         }
 
         Comp comp;
 
-        bool up_comp(T const& a, T const& b) const {
+        template<typename K>
+        bool up_comp(T const& a, K const& b) const {
             return !(comp(b, a));
         }
 
     private:
+        template<bool Is_up_comp, typename K>
+        node_t* bound(K const& val) const {
+            return bound<Is_up_comp>(val, head, nullptr);
+        }
+
+        // Descends from t with res as the best candidate so far.
+        template<bool Is_up_comp, typename K>
+        node_t* bound(K const& val, node_t* t, node_t* res) const {
+            while (t) {
+                bool comp_res;
+                if constexpr (Is_up_comp) {
+                    comp_res = !is_valuable(t) || !up_comp(t->get_value(), val);
+                } else {
+                    comp_res = !is_valuable(t) || !comp(t->get_value(), val);
+                }
+                if (comp_res) {
+                    res = t;
+                    t = t->left;
+                } else {
+                    t = t->right;
+                }
+            }
+            return res;
+        }
+
         template<bool Is_up_comp>
-        node_t* bound(node_t* ptr, T const& val) const noexcept {
-            if (!ptr) {
-                return nullptr;
+        ptr_pair split(node_t* t, T const& val) noexcept {
+            node_t* l_root = nullptr;
+            node_t* r_root = nullptr;
+            node_t* l_last = nullptr;
+            node_t* r_last = nullptr;
+            while (t) {
+                bool comp_res;
+                if constexpr (Is_up_comp) {
+                    comp_res = is_valuable(t) && up_comp(t->get_value(), val);
+                } else {
+                    comp_res = is_valuable(t) && comp(t->get_value(), val);
+                }
+                if (comp_res) {
+                    (l_last ? l_last->right : l_root) = t;
+                    t->p = l_last;
+                    l_last = t;
+                    t = t->right;
+                } else {
+                    (r_last ? r_last->left : r_root) = t;
+                    t->p = r_last;
+                    r_last = t;
+                    t = t->left;
+                }
             }
-            bool comp_res;
-            if constexpr (Is_up_comp) {
-                comp_res = !is_valuable(ptr) || !up_comp(ptr->get_value(), val);
-            } else {
-                comp_res = !is_valuable(ptr) || !comp(ptr->get_value(), val);
+            if (l_last) {
+                l_last->right = nullptr;
             }
-            if (comp_res) {
-                node_t* l_bound = bound<Is_up_comp>(ptr->left, val);
-                if (l_bound) {
-                    return l_bound;
+            if (r_last) {
+                r_last->left = nullptr;
+            }
+            update_path(l_last);
+            update_path(r_last);
+            return {l_root, r_root};
+        }
+
+        // Splits the tree into the nodes before x and x with the nodes after
+        // it. Going up from x, each ancestor joins the side x is not on, with
+        // the part built so far as its child on that side.
+        ptr_pair split_before(node_t* x) noexcept {
+            node_t* l = x->left;
+            node_t* r = x;
+            x->left = nullptr;
+            update(x);
+            node_t* cur = x;
+            for (node_t* p = x->p; p;) {
+                node_t* up = p->p;
+                if (p->left == cur) {
+                    p->left = r;
+                    r->p = p;
+                    r = p;
                 } else {
-                    return ptr;
+                    p->right = l;
+                    if (l) {
+                        l->p = p;
+                    }
+                    l = p;
                 }
+                update(p);
+                cur = p;
+                p = up;
+            }
+            if (l) {
+                l->p = nullptr;
             }
-            return bound<Is_up_comp>(ptr->right, val);
+            r->p = nullptr;
+            return {l, r};
         }
 
-        template<bool Is_up_comp>
-        ptr_pair split(node_t* t, T const& val) noexcept {
-            if (!t) {
-                return {nullptr, nullptr};
+        // Takes the sentinel out of t, which must hold it, and returns the rest.
+        node_t* without_end(node_t* t) noexcept {
+            node_t* parent = end->p;
+            node_t* lifted = end->left;
+            if (lifted) {
+                lifted->p = parent;
             }
-            clear_parents(t);
-            bool comp_res;
-            if constexpr (Is_up_comp) {
-            comp_res = is_valuable(t) && up_comp(t->get_value(), val);
+            if (parent) {
+                (parent->left == end ? parent->left : parent->right) = lifted;
+                update_path(parent);
             } else {
-            comp_res = is_valuable(t) && comp(t->get_value(), val);
+                t = lifted;
             }
-            if (comp_res) {
-                ptr_pair res = split<Is_up_comp>(t->right, val);
-                t->right = res.first;
-                ensure_parents(t);
-                return {t, res.second};
-            } else {
-                ptr_pair res = split<Is_up_comp>(t->left, val);
-                t->left = res.second;
-                ensure_parents(t);
-                return {res.first, t};
+            end->left = nullptr;
+            end->p = nullptr;
+            update(end);
+            return t;
+        }
+
+        static node_t* leftmost(node_t* t) noexcept {
+            while (t->left) {
+                t = t->left;
+            }
+            return t;
+        }
+
+        // Unites two treaps with disjoint keys, at most one of which holds the
+        // sentinel. The root of higher priority stays on top, the other treap
+        // is split by its key, and the left halves are united first. A node
+        // whose right halves still wait is kept on a stack threaded through
+        // the parent pointers of those halves: the right child points to the
+        // other half, which points to the next node on the stack. Each result
+        // subtree holds exactly the nodes of the two treaps it came from, so
+        // subtree sizes are set on the way down.
+        node_t* unite(node_t* a, node_t* b) noexcept {
+            node_t* root = nullptr;
+            node_t* parent = nullptr;
+            node_t** slot = &root;
+            node_t* pending = nullptr;
+            while (true) {
+                if (!a || !b) {
+                    *slot = a ? a : b;
+                    if (*slot) {
+                        (*slot)->p = parent;
+                    }
+                    if (!pending) {
+                        return root;
+                    }
+                    parent = pending;
+                    slot = &parent->right;
+                    a = parent->right;
+                    b = a->p;
+                    pending = b->p;
+                    b->p = nullptr;
+                    continue;
+                }
+                if (get_priority(b) < get_priority(a)) {
+                    std::swap(a, b);
+                }
+                if constexpr (Owner::counted) {
+                    a->size += size_of(b);
+                }
+                *slot = a;
+                a->p = parent;
+                if (is_valuable(a)) {
+                    ptr_pair parts = split<false>(b, a->get_value());
+                    if (a->right && parts.second) {
+                        a->right->p = parts.second;
+                        parts.second->p = pending;
+                        pending = a;
+                    } else if (parts.second) {
+                        a->right = parts.second;
+                        a->right->p = a;
+                    }
+                    b = parts.first;
+                }
+                parent = a;
+                slot = &a->left;
+                a = a->left;
             }
         }
 
         node_t* merge(node_t* l, node_t* r) noexcept {
-            if (!l) {
-                return r;
+            node_t* root = nullptr;
+            node_t* parent = nullptr;
+            node_t** slot = &root;
+            while (l && r) {
+                if (get_priority(l) < get_priority(r)) {
+                    *slot = l;
+                    l->p = parent;
+                    parent = l;
+                    slot = &l->right;
+                    l = l->right;
+                } else {
+                    *slot = r;
+                    r->p = parent;
+                    parent = r;
+                    slot = &r->left;
+                    r = r->left;
+                }
             }
-            if (!r) {
-                return l;
+            *slot = l ? l : r;
+            if (*slot) {
+                (*slot)->p = parent;
             }
-            if (l->get_priority() < r->get_priority()) {
-                l->right = merge(l->right, r);
-                ensure_parents(l);
-                return l;
+            update_path(parent);
+            return root;
+        }
+
+        static std::size_t size_of(node_t* t) noexcept {
+            return t ? t->size : 0;
+        }
+
+        static void update(node_t* t) noexcept {
+            if constexpr (Owner::counted) {
+                t->size = 1 + size_of(t->left) + size_of(t->right);
+            }
+        }
+
+        static void update_path(node_t* t) noexcept {
+            if constexpr (Owner::counted) {
+                for (; t; t = t->p) {
+                    update(t);
+                }
+            }
+        }
+
+        static uint32_t get_priority(node_t* t) noexcept {
+            return static_cast<Owner*>(t)->get_priority();
+        }
+
+        static void rotate_up(node_t* t) noexcept {
+            node_t* parent = t->p;
+            node_t* grand = parent->p;
+            if (parent->left == t) {
+                parent->left = t->right;
+                t->right = parent;
             } else {
-                r->left = merge(l, r->left);
-                ensure_parents(r);
-                return r;
+                parent->right = t->left;
+                t->left = parent;
+            }
+            ensure_parents(parent);
+            t->p = grand;
+            parent->p = t;
+            update(parent);
+            update(t);
+            if (grand) {
+                (grand->left == parent ? grand->left : grand->right) = t;
             }
         }
 
@@ -265,23 +895,21 @@ namespace {
             }
         }
 
-        static void clear_parents(node_t* t) noexcept {
-            if (t->left) {
-                t->left->p = nullptr;
-            }
-            if (t->right) {
-                t->right->p = nullptr;
-            }
-        }
-
-        template<typename Delete_type>
-        static void destroy(node_t* ptr) {
-            if (!ptr) {
-                return;
+        // Rotates left children up until the top has none, so the tree is
+        // torn down in O(n) without recursion or an explicit stack.
+        template<typename Deleter>
+        static void destroy(node_t* ptr, Deleter& deleter) {
+            while (ptr) {
+                if (node_t* l = ptr->left) {
+                    ptr->left = l->right;
+                    l->right = ptr;
+                    ptr = l;
+                } else {
+                    node_t* r = ptr->right;
+                    deleter(static_cast<Owner*>(ptr));
+                    ptr = r;
+                }
             }
-            destroy<Delete_type>(ptr->left);
-            destroy<Delete_type>(ptr->right);
-            delete static_cast<Delete_type>(ptr);
         }
 
         node_t* head;
@@ -289,143 +917,383 @@ namespace {
         node_t* end;
     };
 
-    template<typename T, typename Tag, typename Comp>
-    struct base_iterator {
-        using node_t = node<T, Tag>;
-        using tree_t = tree<T, Tag, Comp>;
+    struct node_pool {
+        static constexpr std::size_t granularity = alignof(std::max_align_t);
+        static constexpr std::size_t max_size = 1024;
+        static constexpr std::size_t slab_size = 1 << 16;
 
-        base_iterator(node_t* node) noexcept : it_node(node) {}
+        template<typename T>
+        static constexpr bool fits = sizeof(T) <= max_size && alignof(T) <= granularity;
 
-        T const& operator*() const noexcept {
-            return it_node->get_value();
+        node_pool() noexcept : free_lists() {}
+
+        node_pool(node_pool const&) = delete;
+        node_pool& operator=(node_pool const&) = delete;
+
+        ~node_pool() {
+            for (void* slab : slabs) {
+                ::operator delete(slab);
+            }
         }
 
-    protected:
-        template<typename Iterator, typename Ptr>
-        static Iterator prefix_transform(Iterator& cur, std::function<Ptr (Ptr)> transformer) noexcept {
-            Iterator old(cur);
-            cur.it_node = transformer(cur.it_node);
-            return old;
+        void* allocate(std::size_t size) {
+            free_chunk*& head = free_lists[size_class(size)];
+            if (!head) {
+                head = refill(size_class(size));
+            }
+            free_chunk* res = head;
+            head = head->next;
+            return res;
         }
 
-        template<typename Iterator, typename Ptr>
-        static Iterator& postfix_transform(Iterator& cur, std::function<Ptr (Ptr)> transformer) noexcept {
-            cur.it_node = transformer(cur.it_node);
-            return cur;
+        void deallocate(void* ptr, std::size_t size) noexcept {
+            free_chunk*& head = free_lists[size_class(size)];
+            head = new (ptr) free_chunk{head};
         }
 
-        node_t* it_node;
-    };
-}
+    private:
+        struct free_chunk {
+            free_chunk* next;
+        };
 
-template <typename Left, typename Right,
-        typename CompareLeft = std::less<Left>,
-        typename CompareRight = std::less<Right>>
-struct bimap {
-    using left_t = Left;
-    using right_t = Right;
+        static std::size_t size_class(std::size_t size) noexcept {
+            return (size - 1) / granularity;
+        }
 
-    struct left_iterator;
+        free_chunk* refill(std::size_t cls) {
+            std::size_t chunk = (cls + 1) * granularity;
+            std::size_t count = std::max<std::size_t>(slab_size / chunk, 16);
+            slabs.reserve(slabs.size() + 1);
+            auto* slab = static_cast<char*>(::operator new(chunk * count));
+            slabs.push_back(slab);
+            free_chunk* head = nullptr;
+            for (std::size_t i = count; i-- > 0;) {
+                head = new (slab + i * chunk) free_chunk{head};
+            }
+            return head;
+        }
 
-    struct right_iterator : base_iterator<Right, right_tag, CompareRight> {
-        using base = base_iterator<Right, right_tag, CompareRight>;
-        using tree_t = tree<Right, right_tag, CompareRight>;
+        std::array<free_chunk*, max_size / granularity> free_lists;
+        std::vector<void*> slabs;
+    };
 
-        friend struct bimap<Left, Right, CompareLeft, CompareRight>;
+    template<typename Comp, typename = void>
+    struct is_transparent : std::false_type {};
 
-        right_iterator(node<Right, right_tag>* node) noexcept : base(node) {}
+    template<typename Comp>
+    struct is_transparent<Comp, std::void_t<typename Comp::is_transparent>> : std::true_type {};
 
-        right_iterator& operator++() noexcept {
-            base::it_node = tree_t::next(base::it_node);
-            return *this;
-        }
+    template<typename K, typename Key, typename Comp>
+    using lookup_key = std::enable_if_t<is_transparent<Comp>::value || std::is_same_v<K, Key>>;
 
-        right_iterator operator++(int) noexcept {
-            auto old = *this;
-            ++(*this);
-            return old;
-        }
+    template<typename It, typename = void>
+    struct is_iterator : std::false_type {};
 
-        right_iterator& operator--() noexcept {
-            base::it_node = tree_t::prev(base::it_node);
-            return *this;
-        }
+    template<typename It>
+    struct is_iterator<It, std::void_t<typename std::iterator_traits<It>::iterator_category>> : std::true_type {};
 
-        right_iterator operator--(int) noexcept {
-            auto old = *this;
-            --(*this);
-            return old;
-        }
+    // A pair of iterators for range-based for loops.
+    template<typename It>
+    struct iterator_range {
+        iterator_range(It first, It last) noexcept : first(first), last(last) {}
 
-        friend bool operator==(right_iterator const& a, right_iterator const& b) {
-            return a.base::it_node == b.base::it_node;
+        It begin() const noexcept {
+            return first;
         }
 
-        friend bool operator!=(right_iterator const& a, right_iterator const& b) {
-            return !(a == b);
+        It end() const noexcept {
+            return last;
         }
 
-        left_iterator flip() const noexcept {
-            return static_cast<bi_node*>(base::it_node);
+        bool empty() const noexcept {
+            return first == last;
         }
+
+    private:
+        It first;
+        It last;
+    };
+
+    struct ignore_duplicate {
+        template<typename L, typename R>
+        void operator()(L const&, R const&) const noexcept {}
     };
 
+    // Keys that load can read as bytes into default constructed keys.
+    template<typename T>
+    constexpr bool is_storable_v = std::is_trivially_copyable_v<T> && std::is_default_constructible_v<T>;
 
-    struct left_iterator : base_iterator<Left, left_tag, CompareLeft> {
-        using base = base_iterator<Left, left_tag, CompareLeft>;
-        using tree_t = tree<Left, left_tag, CompareLeft>;
+    template<typename Alloc, typename = void>
+    struct is_bulk_releasing : std::false_type {};
 
-        friend struct bimap<Left, Right, CompareLeft, CompareRight>;
+    template<typename Alloc>
+    struct is_bulk_releasing<Alloc, std::void_t<typename Alloc::is_bulk_releasing>> : Alloc::is_bulk_releasing {};
 
-        left_iterator(node<Left, left_tag>* node) noexcept : base(node) {}
+    // Shared core of left_iterator and right_iterator. Tree provides static
+    // next and prev, which are called directly so every step inlines.
+    template<typename Derived, typename T, typename Tag, typename Tree>
+    struct base_iterator {
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T const*;
+        using reference = T const&;
+        using node_t = typename Tree::node_t;
 
-        left_iterator& operator++() noexcept {
-            base::it_node = tree_t::next(base::it_node);
-            return *this;
+        base_iterator() noexcept : it_node(nullptr) {}
+
+        base_iterator(node_t* node) noexcept : it_node(node) {}
+
+        T const& operator*() const noexcept {
+            return it_node->get_value();
         }
 
-        left_iterator operator++(int) noexcept {
-            auto old = *this;
+        T const* operator->() const noexcept {
+            return &it_node->get_value();
+        }
+
+        Derived& operator++() noexcept {
+            it_node = Tree::next(it_node);
+            return self();
+        }
+
+        Derived operator++(int) noexcept {
+            Derived old = self();
             ++(*this);
             return old;
         }
 
-        left_iterator& operator--() noexcept {
-            base::it_node = tree_t::prev(base::it_node);
-            return *this;
+        Derived& operator--() noexcept {
+            it_node = Tree::prev(it_node);
+            return self();
         }
 
-        left_iterator operator--(int) noexcept {
-            auto old = *this;
+        Derived operator--(int) noexcept {
+            Derived old = self();
             --(*this);
             return old;
         }
 
-        friend bool operator==(left_iterator const& a, left_iterator const& b) {
-            return a.base::it_node == b.base::it_node;
+        friend bool operator==(Derived const& a, Derived const& b) noexcept {
+            return a.it_node == b.it_node;
         }
 
-        friend bool operator!=(left_iterator const& a, left_iterator const& b) {
+        friend bool operator!=(Derived const& a, Derived const& b) noexcept {
             return !(a == b);
         }
 
+    protected:
+        node_t* it_node;
+
+    private:
+        Derived& self() noexcept {
+            return static_cast<Derived&>(*this);
+        }
+    };
+
+    template<typename Bimap, typename Left, typename Right, typename CompareLeft, typename CompareRight, bool Enabled>
+    struct order_statistics {};
+
+    // Queries over subtree sizes, available if bimap is instantiated with
+    // OrderStatistics. All of them take O(log n).
+    template<typename Bimap, typename Left, typename Right, typename CompareLeft, typename CompareRight>
+    struct order_statistics<Bimap, Left, Right, CompareLeft, CompareRight, true> {
+        auto nth_left(std::size_t k) const noexcept {
+            return typename Bimap::left_iterator(self().l_tree.nth(std::min(k, self().size())));
+        }
+
+        auto nth_right(std::size_t k) const noexcept {
+            return typename Bimap::right_iterator(self().r_tree.nth(std::min(k, self().size())));
+        }
+
+        template<typename K, typename = lookup_key<K, Left, CompareLeft>>
+        std::size_t rank_left(K const& left) const noexcept {
+            return self().l_tree.rank(left);
+        }
+
+        std::size_t rank_left(Left const& left) const noexcept {
+            return rank_left<Left>(left);
+        }
+
+        template<typename K, typename = lookup_key<K, Right, CompareRight>>
+        std::size_t rank_right(K const& right) const noexcept {
+            return self().r_tree.rank(right);
+        }
+
+        std::size_t rank_right(Right const& right) const noexcept {
+            return rank_right<Right>(right);
+        }
+
+        template<typename K, typename = lookup_key<K, Left, CompareLeft>>
+        std::size_t count_range_left(K const& lo, K const& hi) const noexcept {
+            std::size_t l = rank_left(lo), r = rank_left(hi);
+            return l < r ? r - l : 0;
+        }
+
+        std::size_t count_range_left(Left const& lo, Left const& hi) const noexcept {
+            return count_range_left<Left>(lo, hi);
+        }
+
+        template<typename K, typename = lookup_key<K, Right, CompareRight>>
+        std::size_t count_range_right(K const& lo, K const& hi) const noexcept {
+            std::size_t l = rank_right(lo), r = rank_right(hi);
+            return l < r ? r - l : 0;
+        }
+
+        std::size_t count_range_right(Right const& lo, Right const& hi) const noexcept {
+            return count_range_right<Right>(lo, hi);
+        }
+
+    private:
+        Bimap const& self() const noexcept {
+            return static_cast<Bimap const&>(*this);
+        }
+    };
+}
+
+template<typename T>
+struct node_pool_allocator {
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_bulk_releasing = std::true_type;
+
+    template<typename U>
+    friend struct node_pool_allocator;
+
+    node_pool_allocator() : pool(std::make_shared<node_pool>()) {}
+
+    template<typename U>
+    node_pool_allocator(node_pool_allocator<U> const& other) noexcept : pool(other.pool) {}
+
+    T* allocate(std::size_t n) {
+        if (node_pool::fits<T> && n == 1) {
+            return static_cast<T*>(pool->allocate(sizeof(T)));
+        }
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* ptr, std::size_t n) noexcept {
+        if (node_pool::fits<T> && n == 1) {
+            pool->deallocate(ptr, sizeof(T));
+        } else {
+            std::allocator<T>().deallocate(ptr, n);
+        }
+    }
+
+    // True if no other allocator copy refers to the pool, so destroying this
+    // one releases every node allocated from it.
+    bool sole_owner() const noexcept {
+        return pool.use_count() == 1;
+    }
+
+    node_pool_allocator select_on_container_copy_construction() const {
+        return node_pool_allocator();
+    }
+
+    template<typename U>
+    friend bool operator==(node_pool_allocator const& a, node_pool_allocator<U> const& b) noexcept {
+        return a.pool == b.pool;
+    }
+
+    template<typename U>
+    friend bool operator!=(node_pool_allocator const& a, node_pool_allocator<U> const& b) noexcept {
+        return !(a == b);
+    }
+
+private:
+    std::shared_ptr<node_pool> pool;
+};
+
+template <typename Left, typename Right,
+        typename CompareLeft = std::less<Left>,
+        typename CompareRight = std::less<Right>>
+struct frozen_bimap;
+
+template <typename Left, typename Right,
+        typename CompareLeft = std::less<Left>,
+        typename CompareRight = std::less<Right>,
+        typename Allocator = std::allocator<std::pair<Left, Right>>,
+        bool OrderStatistics = false>
+struct bimap : order_statistics<bimap<Left, Right, CompareLeft, CompareRight, Allocator, OrderStatistics>, Left, Right,
+                                CompareLeft, CompareRight, OrderStatistics> {
+    using left_t = Left;
+    using right_t = Right;
+
+private:
+    friend struct order_statistics<bimap, Left, Right, CompareLeft, CompareRight, OrderStatistics>;
+    friend struct frozen_bimap<Left, Right, CompareLeft, CompareRight>;
+
+    using l_node = node<Left, left_tag, OrderStatistics>;
+    using r_node = node<Right, right_tag, OrderStatistics>;
+    using bi_node = binode<Left, Right, OrderStatistics>;
+    using node_allocator = typename std::allocator_traits<Allocator>::template rebind_alloc<bi_node>;
+    using node_alloc_traits = std::allocator_traits<node_allocator>;
+
+    template<typename K>
+    using left_key = lookup_key<K, Left, CompareLeft>;
+    template<typename K>
+    using right_key = lookup_key<K, Right, CompareRight>;
+
+public:
+    struct left_iterator;
+
+    struct right_iterator : base_iterator<right_iterator, Right, right_tag, tree<Right, right_tag, CompareRight, bi_node>> {
+        using base = base_iterator<right_iterator, Right, right_tag, tree<Right, right_tag, CompareRight, bi_node>>;
+
+        friend struct bimap<Left, Right, CompareLeft, CompareRight, Allocator, OrderStatistics>;
+
+        right_iterator() noexcept = default;
+
+        right_iterator(r_node* node) noexcept : base(node) {}
+
+        left_iterator flip() const noexcept {
+            return static_cast<bi_node*>(base::it_node);
+        }
+    };
+
+
+    struct left_iterator : base_iterator<left_iterator, Left, left_tag, tree<Left, left_tag, CompareLeft, bi_node>> {
+        using base = base_iterator<left_iterator, Left, left_tag, tree<Left, left_tag, CompareLeft, bi_node>>;
+
+        friend struct bimap<Left, Right, CompareLeft, CompareRight, Allocator, OrderStatistics>;
+
+        left_iterator() noexcept = default;
+
+        left_iterator(l_node* node) noexcept : base(node) {}
+
         right_iterator flip() const noexcept {
             return static_cast<bi_node*>(base::it_node);
         }
     };
 
-    bimap(CompareLeft cmpL = CompareLeft(), CompareRight cmpR = CompareRight()) noexcept : l_tree(new bi_node(), cmpL), r_tree(static_cast<bi_node*>(l_tree.get_end()), cmpR), bimap_size(0) {}
+    bimap(CompareLeft cmpL = CompareLeft(), CompareRight cmpR = CompareRight(), Allocator const& alloc = Allocator()) noexcept
+        : alloc(alloc), l_tree(create_node(), cmpL), r_tree(static_cast<bi_node*>(l_tree.get_end()), cmpR), bimap_size(0) {}
 
-    bimap(bimap const& other): bimap() {
+    template<typename InputIt, typename = std::enable_if_t<is_iterator<InputIt>::value>>
+    bimap(InputIt first, InputIt last, CompareLeft cmpL = CompareLeft(), CompareRight cmpR = CompareRight(),
+          Allocator const& alloc = Allocator())
+        : bimap(cmpL, cmpR, alloc) {
+        assign(first, last);
+    }
+
+    bimap(bimap const& other)
+        : bimap(other.l_tree.comp, other.r_tree.comp, node_alloc_traits::select_on_container_copy_construction(other.alloc)) {
         copy(other);
     }
 
-    bimap(bimap&& other) noexcept : bimap() {
+    bimap(bimap&& other) noexcept : bimap(other.l_tree.comp, other.r_tree.comp, other.alloc) {
         swap(other);
     }
 
     ~bimap() {
-        l_tree.template destroy<bi_node*>();
+        if constexpr (is_bulk_releasing<node_allocator>::value && std::is_trivially_destructible_v<bi_node>) {
+            // Nodes go away with the pool only if no other allocator shares it.
+            if (alloc.sole_owner()) {
+                return;
+            }
+        }
+        l_tree.destroy([this](bi_node* ptr) { destroy_node(ptr); });
     }
 
     bimap& operator=(bimap const& other) {
@@ -445,39 +1313,467 @@ struct bimap {
     }
 
     left_iterator insert(Left const& l_val, Right const& r_val) noexcept {
-        if (find_left(l_val) != end_left() || find_right(r_val) != end_right()) {
-            return end_left();
-        }
-        auto* new_elem = new bi_node(l_val, r_val);
-        insert(new_elem);
-        return new_elem;
+        auto res = try_insert(l_val, r_val);
+        return res.second ? res.first : end_left();
     }
 
     left_iterator insert(Left&& l_val, Right const& r_val) noexcept {
-        if (find_left(l_val) != end_left() || find_right(r_val) != end_right()) {
-            return end_left();
-        }
-        auto* new_elem = new bi_node(std::move(l_val), r_val);
-        insert(new_elem);
-        return new_elem;
+        auto res = try_insert(std::move(l_val), r_val);
+        return res.second ? res.first : end_left();
     }
 
     left_iterator insert(Left const& l_val, Right&& r_val) noexcept {
-        if (find_left(l_val) != end_left() || find_right(r_val) != end_right()) {
-            return end_left();
-        }
-        auto* new_elem = new bi_node(l_val, std::move(r_val));
-        insert(new_elem);
-        return new_elem;
+        auto res = try_insert(l_val, std::move(r_val));
+        return res.second ? res.first : end_left();
     }
 
     left_iterator insert(Left&& l_val, Right&& r_val) noexcept {
-        if (find_left(l_val) != end_left() || find_right(r_val) != end_right()) {
-            return end_left();
+        auto res = try_insert(std::move(l_val), std::move(r_val));
+        return res.second ? res.first : end_left();
+    }
+
+    template<typename L = Left, typename R = Right,
+            typename = std::enable_if_t<std::is_same_v<std::decay_t<L>, Left> && std::is_same_v<std::decay_t<R>, Right>>>
+    std::pair<left_iterator, bool> try_insert(L&& l_val, R&& r_val) {
+        auto l_pos = l_tree.locate(l_val);
+        if (l_pos.found) {
+            return {l_pos.found, false};
+        }
+        auto r_pos = r_tree.locate(r_val);
+        if (r_pos.found) {
+            return {static_cast<bi_node*>(r_pos.found), false};
+        }
+        bi_node* new_elem = create_node(std::forward<L>(l_val), std::forward<R>(r_val));
+        l_tree.insert(l_pos, new_elem);
+        r_tree.insert(r_pos, new_elem);
+        bimap_size++;
+        return {new_elem, true};
+    }
+
+    // Insertion next to hint: the left position is searched for from hint up,
+    // so inserting keys in or near sorted order is amortized O(1) on the left
+    // side. Any hint gives the same result as a plain insert.
+    left_iterator insert(left_iterator hint, Left const& l_val, Right const& r_val) {
+        auto res = try_insert(hint, l_val, r_val);
+        return res.second ? res.first : end_left();
+    }
+
+    left_iterator insert(left_iterator hint, Left&& l_val, Right const& r_val) {
+        auto res = try_insert(hint, std::move(l_val), r_val);
+        return res.second ? res.first : end_left();
+    }
+
+    left_iterator insert(left_iterator hint, Left const& l_val, Right&& r_val) {
+        auto res = try_insert(hint, l_val, std::move(r_val));
+        return res.second ? res.first : end_left();
+    }
+
+    left_iterator insert(left_iterator hint, Left&& l_val, Right&& r_val) {
+        auto res = try_insert(hint, std::move(l_val), std::move(r_val));
+        return res.second ? res.first : end_left();
+    }
+
+    template<typename L = Left, typename R = Right,
+            typename = std::enable_if_t<std::is_same_v<std::decay_t<L>, Left> && std::is_same_v<std::decay_t<R>, Right>>>
+    std::pair<left_iterator, bool> try_insert(left_iterator hint, L&& l_val, R&& r_val) {
+        auto l_pos = l_tree.locate(l_val, l_tree.finger(hint.it_node, l_val));
+        if (l_pos.found) {
+            return {l_pos.found, false};
+        }
+        auto r_pos = r_tree.locate(r_val);
+        if (r_pos.found) {
+            return {static_cast<bi_node*>(r_pos.found), false};
+        }
+        bi_node* new_elem = create_node(std::forward<L>(l_val), std::forward<R>(r_val));
+        l_tree.insert(l_pos, new_elem);
+        r_tree.insert(r_pos, new_elem);
+        bimap_size++;
+        return {new_elem, true};
+    }
+
+    template<typename... L_args, typename... R_args>
+    std::pair<left_iterator, bool> emplace(std::piecewise_construct_t, std::tuple<L_args...> l_args, std::tuple<R_args...> r_args) {
+        return try_insert(make_probe<Left>(std::move(l_args)), make_probe<Right>(std::move(r_args)));
+    }
+
+    template<typename L, typename R>
+    std::pair<left_iterator, bool> emplace(L&& l_arg, R&& r_arg) {
+        return emplace(std::piecewise_construct, std::forward_as_tuple(std::forward<L>(l_arg)),
+                       std::forward_as_tuple(std::forward<R>(r_arg)));
+    }
+
+    // Inserts the pairs of [first, last) with the same outcome as inserting
+    // them one by one, and returns whether each of them was inserted. Nodes
+    // are only created for the pairs that get inserted, and if anything
+    // throws the bimap is left unchanged. Into a tree that still fits in
+    // cache the pairs are just inserted in turn, and unlinked again on a
+    // throw. Otherwise the
+    // distinct keys of the batch are located in both trees up front with
+    // interleaved descents in key order. An insertion only changes the null
+    // slot it fills, so the other positions stay valid, and keys sharing a
+    // slot are located again.
+    template<typename InputIt>
+    std::vector<bool> insert_batch(InputIt first, InputIt last) {
+        using category = typename std::iterator_traits<InputIt>::iterator_category;
+        using reference = typename std::iterator_traits<InputIt>::reference;
+        std::vector<bool> inserted;
+        if (size() < batch_locate_size) {
+            std::vector<bi_node*> added;
+            try {
+                for (; first != last; ++first) {
+                    auto&& kv = *first;
+                    added.push_back(nullptr);
+                    auto res = emplace(std::get<0>(std::forward<decltype(kv)>(kv)),
+                                       std::get<1>(std::forward<decltype(kv)>(kv)));
+                    if (res.second) {
+                        added.back() = static_cast<bi_node*>(res.first.it_node);
+                    } else {
+                        added.pop_back();
+                    }
+                    inserted.push_back(res.second);
+                }
+            } catch (...) {
+                for (bi_node* ptr : added) {
+                    if (ptr) {
+                        erase(ptr);
+                    }
+                }
+                throw;
+            }
+            return inserted;
+        }
+
+        // Pairs stored as Left and Right are read in place, others are
+        // converted into a buffer first.
+        constexpr bool in_place = std::is_base_of_v<std::forward_iterator_tag, category> &&
+                                  std::is_lvalue_reference_v<decltype(std::get<0>(std::declval<reference>()))> &&
+                                  std::is_lvalue_reference_v<decltype(std::get<1>(std::declval<reference>()))> &&
+                                  std::is_same_v<std::decay_t<decltype(std::get<0>(std::declval<reference>()))>, Left> &&
+                                  std::is_same_v<std::decay_t<decltype(std::get<1>(std::declval<reference>()))>, Right>;
+        std::vector<std::pair<Left, Right>> buffer;
+        std::vector<Left const*> lefts;
+        std::vector<Right const*> rights;
+        if constexpr (in_place) {
+            lefts.reserve(std::distance(first, last));
+            rights.reserve(lefts.capacity());
+            for (; first != last; ++first) {
+                lefts.push_back(&std::get<0>(*first));
+                rights.push_back(&std::get<1>(*first));
+            }
+        } else {
+            for (; first != last; ++first) {
+                auto&& kv = *first;
+                buffer.emplace_back(std::get<0>(std::forward<decltype(kv)>(kv)), std::get<1>(std::forward<decltype(kv)>(kv)));
+            }
+            lefts.reserve(buffer.size());
+            rights.reserve(buffer.size());
+            for (auto const& kv : buffer) {
+                lefts.push_back(&kv.first);
+                rights.push_back(&kv.second);
+            }
+        }
+
+        pending_nodes pending(*this, lefts.size());
+        inserted = insert_nodes(lefts, rights, [&](std::size_t i) {
+            if constexpr (in_place) {
+                pending.nodes.push_back(create_node(*lefts[i], *rights[i]));
+            } else {
+                pending.nodes.push_back(create_node(std::move(buffer[i].first), std::move(buffer[i].second)));
+            }
+            return pending.nodes.back();
+        });
+        pending.nodes.clear();
+        return inserted;
+    }
+
+    // Moves the pairs of other whose keys are both free in this bimap over,
+    // as if inserted one by one in left order. The rest stay in other. When
+    // the allocators differ the pairs are copied over one at a time, and an
+    // exception leaves the ones moved so far here.
+    void merge(bimap&& other) {
+        if (this == &other) {
+            return;
+        }
+        if (!(alloc == other.alloc)) {
+            for (auto it = other.begin_left(); it != other.end_left();) {
+                if (try_insert(*it, *it.flip()).second) {
+                    it = other.erase_left(it);
+                } else {
+                    it++;
+                }
+            }
+            return;
+        }
+        std::vector<bi_node*> nodes;
+        std::vector<Left const*> lefts;
+        std::vector<Right const*> rights;
+        nodes.reserve(other.size());
+        lefts.reserve(other.size());
+        rights.reserve(other.size());
+        for (auto it = other.begin_left(); it != other.end_left(); it++) {
+            nodes.push_back(static_cast<bi_node*>(it.it_node));
+            lefts.push_back(&*it);
+            rights.push_back(&*it.flip());
+        }
+        insert_nodes(lefts, rights, [&](std::size_t i) noexcept {
+            bi_node* ptr = nodes[i];
+            other.l_tree.erase(ptr);
+            other.r_tree.erase(ptr);
+            other.bimap_size--;
+            decltype(l_tree)::reset(ptr);
+            decltype(r_tree)::reset(ptr);
+            return ptr;
+        });
+    }
+
+    // Keeps only the pairs that other holds as well.
+    void intersect(bimap const& other) {
+        match_left(other, [this](bi_node* ptr, bi_node const* match) {
+            if (!match || !r_tree.equal(ptr->r_node::get_value(), match->r_node::get_value())) {
+                erase(ptr);
+            }
+        });
+    }
+
+    // Removes the pairs that other holds as well.
+    void difference(bimap const& other) {
+        match_left(other, [this](bi_node* ptr, bi_node const* match) {
+            if (match && r_tree.equal(ptr->r_node::get_value(), match->r_node::get_value())) {
+                erase(ptr);
+            }
+        });
+    }
+
+    // Moves the pairs with left keys not less than left into the returned
+    // bimap in O(log n + k log k), where k is the size of the smaller part.
+    template<typename K, typename = left_key<K>>
+    bimap split_left(K const& left) {
+        return split_at<&bimap::l_tree, &bimap::r_tree>(left);
+    }
+
+    bimap split_left(Left const& left) {
+        return split_left<Left>(left);
+    }
+
+    template<typename K, typename = right_key<K>>
+    bimap split_right(K const& right) {
+        return split_at<&bimap::r_tree, &bimap::l_tree>(right);
+    }
+
+    bimap split_right(Right const& right) {
+        return split_right<Right>(right);
+    }
+
+    // Moves all pairs of other over. Its left keys must all be greater than
+    // the ones here, and its right keys must be distinct from the ones here;
+    // otherwise std::invalid_argument is thrown and neither bimap changes.
+    // The left trees are concatenated in O(log n) and the right trees are
+    // united in expected O(m log(n / m + 1)) for m <= n, after an O(m log n)
+    // check of the right keys. When the allocators differ the pairs of other
+    // are copied instead.
+    void join(bimap&& other) {
+        if (this == &other || other.empty()) {
+            return;
+        }
+        if (!empty() &&
+            !l_tree.comp(l_tree.prev(l_tree.get_end())->get_value(), other.l_tree.get_begin()->get_value())) {
+            throw std::invalid_argument("bimap::join: left keys are not greater");
+        }
+        if (shares_right(other)) {
+            throw std::invalid_argument("bimap::join: right keys overlap");
+        }
+        if (!(alloc == other.alloc)) {
+            bimap copy(l_tree.comp, r_tree.comp, alloc);
+            for (auto it = other.begin_left(); it != other.end_left(); it++) {
+                copy.insert(copy.end_left(), *it, *it.flip());
+            }
+            splice(copy);
+            other.erase_left(other.begin_left(), other.end_left());
+            return;
+        }
+        splice(other);
+    }
+
+    struct diff_result {
+        std::vector<left_iterator> added;
+        std::vector<left_iterator> removed;
+        std::vector<std::pair<left_iterator, left_iterator>> changed;
+    };
+
+    // Compares a with b by left key: added points into b, removed into a, and
+    // changed holds the pairs of both whose right keys differ.
+    friend diff_result diff(bimap const& a, bimap const& b) {
+        diff_result res;
+        auto it = b.begin_left();
+        for (auto cur = a.begin_left(); cur != a.end_left(); cur++) {
+            for (; it != b.end_left() && a.l_tree.comp(*it, *cur); it++) {
+                res.added.push_back(it);
+            }
+            if (it == b.end_left() || a.l_tree.comp(*cur, *it)) {
+                res.removed.push_back(cur);
+            } else {
+                if (!a.r_tree.equal(*cur.flip(), *it.flip())) {
+                    res.changed.emplace_back(cur, it);
+                }
+                it++;
+            }
+        }
+        for (; it != b.end_left(); it++) {
+            res.added.push_back(it);
+        }
+        return res;
+    }
+
+    // Replaces the contents with the pairs of [first, last) in O(n log n), or
+    // in O(n) if the range is sorted by left key. Of pairs with equal left
+    // keys the first one in the range is kept; after that, of pairs with equal
+    // right keys the one with the smallest left key is kept.
+    template<typename InputIt>
+    void assign(InputIt first, InputIt last, bool sorted_by_left = false) {
+        bimap res(l_tree.comp, r_tree.comp, alloc);
+        std::vector<bi_node*> nodes;
+        if constexpr (std::is_base_of_v<std::forward_iterator_tag, typename std::iterator_traits<InputIt>::iterator_category>) {
+            nodes.reserve(std::distance(first, last));
+        }
+        try {
+            for (; first != last; ++first) {
+                nodes.push_back(nullptr);
+                auto&& kv = *first;
+                nodes.back() = res.create_node(std::get<0>(std::forward<decltype(kv)>(kv)),
+                                               std::get<1>(std::forward<decltype(kv)>(kv)));
+            }
+        } catch (...) {
+            for (bi_node* ptr : nodes) {
+                if (ptr) {
+                    res.destroy_node(ptr);
+                }
+            }
+            throw;
+        }
+        res.build(std::move(nodes), sorted_by_left);
+        swap(res);
+    }
+
+    // Builds a bimap from pairs read once from [first, last), holding on to
+    // no more than a pointer per pair besides the nodes. While the input is
+    // sorted by left key, as assume_sorted_left promises, the left tree grows
+    // on its right spine as pairs arrive; otherwise the nodes are sorted by
+    // left key first. The right tree is then built from the nodes sorted by
+    // right key. A pair whose left key is taken by an earlier pair, or whose
+    // right key is taken by a pair with a smaller left key, is dropped and
+    // passed to on_duplicate.
+    template<typename InputIt, typename OnDuplicate = ignore_duplicate>
+    static bimap from_stream(InputIt first, InputIt last, bool assume_sorted_left = false,
+                             OnDuplicate&& on_duplicate = OnDuplicate(), CompareLeft cmpL = CompareLeft(),
+                             CompareRight cmpR = CompareRight(), Allocator const& alloc = Allocator()) {
+        bimap res(cmpL, cmpR, alloc);
+        std::vector<bi_node*> nodes;
+        l_node* top = nullptr;
+        l_node* rightmost = nullptr;
+        bool sorted = assume_sorted_left;
+        try {
+            for (; first != last; ++first) {
+                auto&& kv = *first;
+                if (sorted && rightmost) {
+                    Left const& prev = rightmost->get_value();
+                    if (!res.l_tree.comp(prev, std::get<0>(kv))) {
+                        if (!res.l_tree.comp(std::get<0>(kv), prev)) {
+                            on_duplicate(std::get<0>(kv), std::get<1>(kv));
+                            continue;
+                        }
+                        sorted = false;
+                    }
+                }
+                nodes.push_back(nullptr);
+                nodes.back() = res.create_node(std::get<0>(std::forward<decltype(kv)>(kv)),
+                                               std::get<1>(std::forward<decltype(kv)>(kv)));
+                if (sorted) {
+                    decltype(res.l_tree)::spine_append(top, rightmost, nodes.back());
+                }
+            }
+            if (!sorted) {
+                std::stable_sort(nodes.begin(), nodes.end(), [&res](bi_node* a, bi_node* b) { return res.less_left(a, b); });
+                bi_node* prev = nullptr;
+                for (bi_node*& ptr : nodes) {
+                    if (prev && !res.less_left(prev, ptr)) {
+                        on_duplicate(ptr->l_node::get_value(), ptr->r_node::get_value());
+                        res.destroy_node(std::exchange(ptr, nullptr));
+                    } else {
+                        prev = ptr;
+                    }
+                }
+                nodes.erase(std::remove(nodes.begin(), nodes.end(), nullptr), nodes.end());
+                top = rightmost = nullptr;
+                for (bi_node* ptr : nodes) {
+                    decltype(res.l_tree)::spine_append(top, rightmost, ptr);
+                }
+            }
+        } catch (...) {
+            for (bi_node* ptr : nodes) {
+                if (ptr) {
+                    res.destroy_node(ptr);
+                }
+            }
+            throw;
+        }
+        res.l_tree.adopt_spine(top, rightmost, nodes.empty() ? nullptr : nodes.front());
+        res.bimap_size = nodes.size();
+
+        // Stable, so of equal right keys the one with the smallest left key
+        // comes first. From here on the nodes belong to res.
+        std::stable_sort(nodes.begin(), nodes.end(), [&res](bi_node* a, bi_node* b) { return res.less_right(a, b); });
+        std::size_t kept = 0;
+        for (bi_node* ptr : nodes) {
+            if (kept != 0 && !res.less_right(nodes[kept - 1], ptr)) {
+                on_duplicate(ptr->l_node::get_value(), ptr->r_node::get_value());
+                res.l_tree.erase(ptr);
+                res.destroy_node(ptr);
+                res.bimap_size--;
+            } else {
+                nodes[kept++] = ptr;
+            }
+        }
+        nodes.resize(kept);
+        res.r_tree.build(nodes.begin(), nodes.end());
+        return res;
+    }
+
+    // Writes the pairs in the format of frozen_bimap, which load, frozen_bimap
+    // and mapped_bimap read back.
+    template<typename L = Left, typename R = Right,
+            typename = std::enable_if_t<std::is_trivially_copyable_v<L> && std::is_trivially_copyable_v<R>>>
+    void save(std::string const& path) const {
+        frozen_bimap<Left, Right, CompareLeft, CompareRight>(*this).save(path);
+    }
+
+    // Reads a file written by save in O(n), without comparing keys.
+    template<typename L = Left, typename R = Right, typename = std::enable_if_t<is_storable_v<L> && is_storable_v<R>>>
+    static bimap load(std::string const& path, CompareLeft cmpL = CompareLeft(), CompareRight cmpR = CompareRight(),
+                      Allocator const& alloc = Allocator()) {
+        using frozen_t = frozen_bimap<Left, Right, CompareLeft, CompareRight>;
+        frozen_t frozen = frozen_t::load(path, cmpL, cmpR);
+        bimap res(cmpL, cmpR, alloc);
+        std::vector<bi_node*> by_left;
+        std::vector<bi_node*> by_right;
+        std::vector<bi_node*> at_slot(frozen.size());
+        by_left.reserve(frozen.size());
+        by_right.reserve(frozen.size());
+        try {
+            for (auto it = frozen.begin_left(); it != frozen.end_left(); ++it) {
+                by_left.push_back(res.create_node(*it, *it.flip()));
+                at_slot[frozen_t::slot(it) - 1] = by_left.back();
+            }
+        } catch (...) {
+            for (bi_node* ptr : by_left) {
+                res.destroy_node(ptr);
+            }
+            throw;
+        }
+        for (auto it = frozen.begin_right(); it != frozen.end_right(); ++it) {
+            by_right.push_back(at_slot[frozen_t::slot(it.flip()) - 1]);
         }
-        auto* new_elem = new bi_node(std::move(l_val), std::move(r_val));
-        insert(new_elem);
-        return new_elem;
+        res.build(by_left, by_right);
+        return res;
     }
 
     left_iterator erase_left(left_iterator it) {
@@ -487,14 +1783,19 @@ struct bimap {
         return res;
     }
 
-    bool erase_left(Left const& left) {
+    template<typename K, typename = left_key<K>>
+    bool erase_left(K const& left) {
         l_node* ptr = l_tree.find(left);
         if (ptr) {
-            erase_left(ptr);
+            erase(static_cast<bi_node*>(ptr));
         }
         return static_cast<bool>(ptr);
     }
 
+    bool erase_left(Left const& left) {
+        return erase_left<Left>(left);
+    }
+
     right_iterator erase_right(right_iterator it) {
         right_iterator res = it;
         res++;
@@ -502,25 +1803,52 @@ struct bimap {
         return res;
     }
 
-    bool erase_right(Right const& right) {
+    template<typename K, typename = right_key<K>>
+    bool erase_right(K const& right) {
         r_node* ptr = r_tree.find(right);
         if (ptr) {
-            erase_right(ptr);
+            erase(static_cast<bi_node*>(ptr));
         }
         return static_cast<bool>(ptr);
     }
 
-    left_iterator find_left (Left const& left) const noexcept {
+    bool erase_right(Right const& right) {
+        return erase_right<Right>(right);
+    }
+
+    template<typename K, typename = left_key<K>>
+    left_iterator find_left(K const& left) const noexcept {
         l_node* ptr = l_tree.find(left);
         return ptr ? ptr : end_left();
     }
 
-    right_iterator find_right(Right const& right) const noexcept {
+    left_iterator find_left(Left const& left) const noexcept {
+        return find_left<Left>(left);
+    }
+
+    // Searches from hint up, see insert with a hint.
+    template<typename K, typename = left_key<K>>
+    left_iterator find_left(left_iterator hint, K const& left) const noexcept {
+        l_node* ptr = l_tree.find(left, l_tree.finger(hint.it_node, left));
+        return ptr ? ptr : end_left();
+    }
+
+    left_iterator find_left(left_iterator hint, Left const& left) const noexcept {
+        return find_left<Left>(hint, left);
+    }
+
+    template<typename K, typename = right_key<K>>
+    right_iterator find_right(K const& right) const noexcept {
         r_node* ptr = r_tree.find(right);
         return ptr ? ptr : end_right();
     }
 
-    Right const& at_left(Left const& key) const {
+    right_iterator find_right(Right const& right) const noexcept {
+        return find_right<Right>(right);
+    }
+
+    template<typename K, typename = left_key<K>>
+    Right const& at_left(K const& key) const {
         auto* ptr = static_cast<bi_node*>(l_tree.find(key));
         if (!ptr) {
             throw std::out_of_range("No such key in bimap");
@@ -528,7 +1856,12 @@ struct bimap {
         return ptr->r_node::get_value();
     }
 
-    Left const& at_right(Right const& key) const {
+    Right const& at_left(Left const& key) const {
+        return at_left<Left>(key);
+    }
+
+    template<typename K, typename = right_key<K>>
+    Left const& at_right(K const& key) const {
         auto* ptr = static_cast<bi_node*>(r_tree.find(key));
         if (!ptr) {
             throw std::out_of_range("No such key in bimap");
@@ -536,6 +1869,10 @@ struct bimap {
         return ptr->l_node::get_value();
     }
 
+    Left const& at_right(Right const& key) const {
+        return at_right<Right>(key);
+    }
+
     template<typename U = Right, typename = std::enable_if_t<std::is_default_constructible_v<U>>>
     Right const& at_left_or_default(Left const& key) noexcept {
         auto* ptr = static_cast<bi_node*>(l_tree.find(key));
@@ -566,39 +1903,104 @@ struct bimap {
         }
     }
 
-    left_iterator lower_bound_left(const Left& left) const noexcept {
+    template<typename K, typename = left_key<K>>
+    left_iterator lower_bound_left(const K& left) const noexcept {
         return l_tree.lower_bound(left);
     }
 
-    left_iterator upper_bound_left(const Left& left) const noexcept {
+    left_iterator lower_bound_left(const Left& left) const noexcept {
+        return lower_bound_left<Left>(left);
+    }
+
+    template<typename K, typename = left_key<K>>
+    left_iterator upper_bound_left(const K& left) const noexcept {
         return l_tree.upper_bound(left);
     }
 
-    right_iterator lower_bound_right(const Right& right) const noexcept {
+    left_iterator upper_bound_left(const Left& left) const noexcept {
+        return upper_bound_left<Left>(left);
+    }
+
+    template<typename K, typename = right_key<K>>
+    right_iterator lower_bound_right(const K& right) const noexcept {
         return r_tree.lower_bound(right);
     }
 
-    right_iterator upper_bound_right(const Right& right) const noexcept {
+    right_iterator lower_bound_right(const Right& right) const noexcept {
+        return lower_bound_right<Right>(right);
+    }
+
+    template<typename K, typename = right_key<K>>
+    right_iterator upper_bound_right(const K& right) const noexcept {
         return r_tree.upper_bound(right);
     }
 
-    left_iterator begin_left() const noexcept {
-        return l_tree.get_begin();
+    right_iterator upper_bound_right(const Right& right) const noexcept {
+        return upper_bound_right<Right>(right);
     }
 
-    left_iterator end_left() const noexcept {
-        return l_tree.get_end();
+    using left_range = iterator_range<left_iterator>;
+    using right_range = iterator_range<right_iterator>;
+
+    // The pairs with left keys in [lo, hi), both ends found in one descent.
+    template<typename K, typename = left_key<K>>
+    left_range range_left(K const& lo, K const& hi) const noexcept {
+        auto ends = l_tree.bounds(lo, hi);
+        return {ends.first, ends.second};
     }
 
-    right_iterator begin_right() const noexcept {
-        return r_tree.get_begin();
+    left_range range_left(Left const& lo, Left const& hi) const noexcept {
+        return range_left<Left>(lo, hi);
     }
 
-    right_iterator end_right() const noexcept {
-        return r_tree.get_end();
+    // Finds the ends from those of a previous range, so sliding a window
+    // along the keys costs O(log d) per step for a shift by d pairs instead
+    // of two descents from the root.
+    template<typename K, typename = left_key<K>>
+    left_range range_left(left_range const& near, K const& lo, K const& hi) const noexcept {
+        return range_from<left_range>(l_tree, near, lo, hi);
     }
 
-    bool empty() const noexcept {
+    left_range range_left(left_range const& near, Left const& lo, Left const& hi) const noexcept {
+        return range_left<Left>(near, lo, hi);
+    }
+
+    template<typename K, typename = right_key<K>>
+    right_range range_right(K const& lo, K const& hi) const noexcept {
+        auto ends = r_tree.bounds(lo, hi);
+        return {ends.first, ends.second};
+    }
+
+    right_range range_right(Right const& lo, Right const& hi) const noexcept {
+        return range_right<Right>(lo, hi);
+    }
+
+    template<typename K, typename = right_key<K>>
+    right_range range_right(right_range const& near, K const& lo, K const& hi) const noexcept {
+        return range_from<right_range>(r_tree, near, lo, hi);
+    }
+
+    right_range range_right(right_range const& near, Right const& lo, Right const& hi) const noexcept {
+        return range_right<Right>(near, lo, hi);
+    }
+
+    left_iterator begin_left() const noexcept {
+        return l_tree.get_begin();
+    }
+
+    left_iterator end_left() const noexcept {
+        return l_tree.get_end();
+    }
+
+    right_iterator begin_right() const noexcept {
+        return r_tree.get_begin();
+    }
+
+    right_iterator end_right() const noexcept {
+        return r_tree.get_end();
+    }
+
+    bool empty() const noexcept {
         return l_tree.empty();
     }
 
@@ -623,43 +2025,407 @@ struct bimap {
     }
 
     left_iterator erase_left(left_iterator first, left_iterator last) {
-        for (auto it = first; it != last;) {
-            bimap_size--;
-            r_node* ptr = static_cast<bi_node*>(it.it_node);
-            it++;
-            r_tree.erase(ptr);
-        }
-        l_tree.template erase_range<bi_node*>(first.it_node, last.it_node);
+        erase_range(l_tree, r_tree, first.it_node, last.it_node);
         return last;
     }
 
     right_iterator erase_right(right_iterator first, right_iterator last) {
-        for (auto it = first; it != last;) {
-            bimap_size--;
-            l_node* ptr = static_cast<bi_node*>(it.it_node);
-            it++;
-            l_tree.erase(ptr);
-        }
-        r_tree.template erase_range<bi_node*>(first.it_node, last.it_node);
+        erase_range(r_tree, l_tree, first.it_node, last.it_node);
         return last;
     }
 
     void swap(bimap& other) noexcept {
+        if constexpr (node_alloc_traits::propagate_on_container_swap::value) {
+            std::swap(alloc, other.alloc);
+        }
         l_tree.swap(other.l_tree);
         r_tree.swap(other.r_tree);
         std::swap(bimap_size, other.bimap_size);
     }
 
 private:
-    using l_node = node<Left, left_tag>;
-    using r_node = node<Right, right_tag>;
-    using bi_node = binode<Left, Right>;
+    template<typename... Args>
+    bi_node* create_node(Args&&... args) {
+        bi_node* ptr = node_alloc_traits::allocate(alloc, 1);
+        try {
+            node_alloc_traits::construct(alloc, ptr, std::forward<Args>(args)...);
+        } catch (...) {
+            node_alloc_traits::deallocate(alloc, ptr, 1);
+            throw;
+        }
+        return ptr;
+    }
+
+    void destroy_node(bi_node* ptr) noexcept {
+        node_alloc_traits::destroy(alloc, ptr);
+        node_alloc_traits::deallocate(alloc, ptr, 1);
+    }
+
+    template<typename Range, typename Tree, typename K>
+    static Range range_from(Tree const& tree, Range const& near, K const& lo, K const& hi) noexcept {
+        auto* first = tree.lower_bound(lo, tree.finger(near.begin().it_node, lo));
+        if (tree.comp(hi, lo)) {
+            return {first, first};
+        }
+        return {first, tree.lower_bound(hi, tree.finger(near.end().it_node, hi))};
+    }
+
+    // A key passed as is is used for the lookup directly. Otherwise it is
+    // built on the stack, so a duplicate never costs a node allocation, and
+    // then moved into the node.
+    template<typename Key, typename Tuple>
+    static decltype(auto) make_probe(Tuple&& args) {
+        using args_t = std::decay_t<Tuple>;
+        if constexpr (std::tuple_size_v<args_t> == 1 && std::is_same_v<std::decay_t<std::tuple_element_t<0, args_t>>, Key>) {
+            return std::get<0>(std::forward<Tuple>(args));
+        } else {
+            return std::make_from_tuple<Key>(std::forward<Tuple>(args));
+        }
+    }
+
+    bool less_left(bi_node const* a, bi_node const* b) const {
+        return l_tree.comp(a->l_node::get_value(), b->l_node::get_value());
+    }
+
+    bool less_right(bi_node const* a, bi_node const* b) const {
+        return r_tree.comp(a->r_node::get_value(), b->r_node::get_value());
+    }
+
+    // Owns nodes created for an operation until they are linked into the
+    // trees, so an exception on the way destroys them.
+    struct pending_nodes {
+        pending_nodes(bimap& owner, std::size_t count) : owner(owner) {
+            nodes.reserve(count);
+        }
+
+        pending_nodes(pending_nodes const&) = delete;
+        pending_nodes& operator=(pending_nodes const&) = delete;
+
+        ~pending_nodes() {
+            for (bi_node* ptr : nodes) {
+                owner.destroy_node(ptr);
+            }
+        }
+
+        bimap& owner;
+        std::vector<bi_node*> nodes;
+    };
+
+    // Below this size the trees stay in cache, and locating a batch up front
+    // costs more in sorting than it saves in misses.
+    static constexpr std::size_t batch_locate_size = std::size_t(1) << 15;
+
+    template<typename Tree, typename T>
+    struct key_groups {
+        std::vector<T const*> keys;
+        std::vector<std::size_t> key_of;
+        std::vector<typename Tree::position> positions;
+        std::vector<bool> taken;
+        std::vector<bi_node*> nodes;
+    };
+
+    // Numbers the distinct keys on the side of tree in sorted order and
+    // locates them, marking the ones already present as taken.
+    template<typename Tree, typename T>
+    static key_groups<Tree, T> group_keys(Tree const& tree, std::vector<T const*> const& keys) {
+        std::vector<std::pair<T const*, std::size_t>> order(keys.size());
+        for (std::size_t i = 0; i < keys.size(); i++) {
+            order[i] = {keys[i], i};
+        }
+        std::sort(order.begin(), order.end(), [&](auto const& a, auto const& b) {
+            return tree.comp(*a.first, *b.first);
+        });
+        key_groups<Tree, T> res{{}, std::vector<std::size_t>(keys.size()), {}, {}, {}};
+        for (auto [cur, i] : order) {
+            if (res.keys.empty() || tree.comp(*res.keys.back(), *cur)) {
+                res.keys.push_back(cur);
+            }
+            res.key_of[i] = res.keys.size() - 1;
+        }
+        res.positions = tree.locate_all(res.keys);
+        res.taken.resize(res.keys.size());
+        res.nodes.resize(res.keys.size());
+        for (std::size_t k = 0; k < res.keys.size(); k++) {
+            res.taken[k] = res.positions[k].found;
+        }
+        return res;
+    }
+
+    // Cuts the tree at key and hands the upper part to a new bimap. The
+    // smaller part is found by walking both in step; its nodes are unlinked
+    // from the other tree and rebuilt into one of their own, and the rest of
+    // the other tree goes to the side that did not get the rebuilt one.
+    // Everything that may throw is done before the first node is unlinked.
+    template<auto Tree, auto Other, typename K>
+    bimap split_at(K const& key) {
+        auto& tree = this->*Tree;
+        auto& other = this->*Other;
+        using other_node = typename std::remove_reference_t<decltype(other)>::node_t;
+        auto* first = tree.lower_bound(key);
+        std::vector<bi_node*> kept, moved;
+        auto* a = tree.get_begin();
+        auto* b = first;
+        for (; a != first && b != tree.get_end(); a = tree.next(a), b = tree.next(b)) {
+            kept.push_back(static_cast<bi_node*>(a));
+            moved.push_back(static_cast<bi_node*>(b));
+        }
+        bool moved_smaller = b == tree.get_end();
+        std::vector<bi_node*>& small = moved_smaller ? moved : kept;
+        std::sort(small.begin(), small.end(), [&other](bi_node* x, bi_node* y) {
+            return other.comp(static_cast<other_node*>(x)->get_value(), static_cast<other_node*>(y)->get_value());
+        });
+        bimap res(l_tree.comp, r_tree.comp, alloc);
+
+        auto& res_tree = res.*Tree;
+        auto& res_other = res.*Other;
+        res_tree.append(tree.cut_before(first));
+        for (bi_node* ptr : small) {
+            other.erase(ptr);
+            std::remove_reference_t<decltype(other)>::reset(ptr);
+        }
+        if (moved_smaller) {
+            res_other.build(small.begin(), small.end());
+            res.bimap_size = small.size();
+        } else {
+            res_other.append(other.release());
+            other.build(small.begin(), small.end());
+            res.bimap_size = bimap_size - small.size();
+        }
+        bimap_size -= res.bimap_size;
+        return res;
+    }
+
+    // Inserts the pairs (lefts[i], rights[i]) that inserting one by one would
+    // accept and returns which ones these are. make(i) supplies the node of
+    // each of them, in order, once everything else that may throw is done.
+    template<typename Make>
+    std::vector<bool> insert_nodes(std::vector<Left const*> const& lefts, std::vector<Right const*> const& rights,
+                                   Make&& make) {
+        auto l_groups = group_keys(l_tree, lefts);
+        auto r_groups = group_keys(r_tree, rights);
+        std::vector<bool> inserted(lefts.size());
+        for (std::size_t i = 0; i < lefts.size(); i++) {
+            std::size_t l_key = l_groups.key_of[i];
+            std::size_t r_key = r_groups.key_of[i];
+            if (!l_groups.taken[l_key] && !r_groups.taken[r_key]) {
+                inserted[i] = l_groups.taken[l_key] = r_groups.taken[r_key] = true;
+            }
+        }
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < lefts.size(); i++) {
+            if (inserted[i]) {
+                bi_node* ptr = make(i);
+                l_groups.nodes[l_groups.key_of[i]] = ptr;
+                r_groups.nodes[r_groups.key_of[i]] = ptr;
+                count++;
+            }
+        }
+        bimap_size += count;
+        insert_located(l_tree, l_groups);
+        insert_located(r_tree, r_groups);
+        return inserted;
+    }
+
+    // Whether some right key is in both bimaps: the keys of the smaller one
+    // are looked up in the larger one, or both are walked in right order when
+    // the sizes are close.
+    bool shares_right(bimap const& other) const {
+        bimap const& small = size() < other.size() ? *this : other;
+        bimap const& large = size() < other.size() ? other : *this;
+        std::size_t depth = 1;
+        while ((std::size_t(1) << depth) < large.size()) {
+            depth++;
+        }
+        if (small.size() * depth < large.size()) {
+            for (auto it = small.begin_right(); it != small.end_right(); it++) {
+                if (large.r_tree.find(*it)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        auto it = large.begin_right();
+        for (auto cur = small.begin_right(); cur != small.end_right(); cur++) {
+            for (; it != large.end_right() && r_tree.comp(*it, *cur); it++) {}
+            if (it != large.end_right() && !r_tree.comp(*cur, *it)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void splice(bimap& other) noexcept {
+        l_tree.append(other.l_tree.release());
+        r_tree.unite_with(other.r_tree.release());
+        bimap_size += other.bimap_size;
+        other.bimap_size = 0;
+    }
+
+    // Walks both bimaps in left order and calls f with every node of this one
+    // and the node of other with the same left key, or nullptr. That takes
+    // O(n + m) comparisons; when other is much larger, the keys of this one
+    // are looked up in it instead. f may erase the node it is given.
+    template<typename F>
+    void match_left(bimap const& other, F&& f) {
+        if (this == &other) {
+            for (auto it = begin_left(); it != end_left();) {
+                auto* ptr = static_cast<bi_node*>((it++).it_node);
+                f(ptr, ptr);
+            }
+            return;
+        }
+        std::size_t depth = 1;
+        while ((std::size_t(1) << depth) < other.size()) {
+            depth++;
+        }
+        if (size() * depth < other.size()) {
+            for (auto cur = begin_left(); cur != end_left();) {
+                auto* ptr = static_cast<bi_node*>((cur++).it_node);
+                f(ptr, static_cast<bi_node const*>(other.l_tree.find(ptr->l_node::get_value())));
+            }
+            return;
+        }
+        auto it = other.begin_left();
+        for (auto cur = begin_left(); cur != end_left();) {
+            auto* ptr = static_cast<bi_node*>((cur++).it_node);
+            Left const& key = ptr->l_node::get_value();
+            for (; it != other.end_left() && l_tree.comp(*it, key); it++) {}
+            bool found = it != other.end_left() && !l_tree.comp(key, *it);
+            f(ptr, found ? static_cast<bi_node const*>(it.it_node) : nullptr);
+        }
+    }
+
+    template<typename Tree, typename T>
+    static void insert_located(Tree& tree, key_groups<Tree, T> const& groups) noexcept {
+        typename Tree::position const* prev = nullptr;
+        for (std::size_t k = 0; k < groups.keys.size(); k++) {
+            auto const& pos = groups.positions[k];
+            if (!groups.nodes[k]) {
+                continue;
+            }
+            typename Tree::node_t* node = groups.nodes[k];
+            if (prev && prev->parent == pos.parent && prev->to_left == pos.to_left) {
+                tree.insert(tree.locate(node->get_value()), node);
+            } else {
+                tree.insert(pos, node);
+            }
+            prev = &pos;
+        }
+    }
+
+    // Takes over nodes and drops the ones with duplicate keys. Duplicates are
+    // only destroyed once all comparisons are done, so if a comparator or an
+    // allocation throws, every node is destroyed and the trees stay empty.
+    void build(std::vector<bi_node*> nodes, bool sorted_by_left) {
+        pending_nodes pending(*this, 0);
+        pending.nodes = std::move(nodes);
+        std::vector<bi_node*> by_left(pending.nodes);
+        if (!sorted_by_left) {
+            std::stable_sort(by_left.begin(), by_left.end(), [this](bi_node* a, bi_node* b) { return less_left(a, b); });
+        }
+        assert(std::is_sorted(by_left.begin(), by_left.end(), [this](bi_node* a, bi_node* b) { return less_left(a, b); }));
+        std::vector<bi_node*> dropped;
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < by_left.size(); i++) {
+            if (kept != 0 && !less_left(by_left[kept - 1], by_left[i])) {
+                dropped.push_back(by_left[i]);
+            } else {
+                by_left[kept++] = by_left[i];
+            }
+        }
+        by_left.resize(kept);
+
+        std::vector<std::size_t> order(by_left.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return less_right(by_left[a], by_left[b]); });
+        std::vector<bi_node*> by_right;
+        by_right.reserve(order.size());
+        for (std::size_t i : order) {
+            if (!by_right.empty() && !less_right(by_right.back(), by_left[i])) {
+                dropped.push_back(by_left[i]);
+                by_left[i] = nullptr;
+            } else {
+                by_right.push_back(by_left[i]);
+            }
+        }
+        by_left.erase(std::remove(by_left.begin(), by_left.end(), nullptr), by_left.end());
+
+        pending.nodes.clear();
+        for (bi_node* ptr : dropped) {
+            destroy_node(ptr);
+        }
+        build(by_left, by_right);
+    }
 
+    void build(std::vector<bi_node*> const& by_left, std::vector<bi_node*> const& by_right) noexcept {
+        l_tree.build(by_left.begin(), by_left.end());
+        r_tree.build(by_right.begin(), by_right.end());
+        bimap_size = by_left.size();
+    }
 
+    // Copies the shape and priorities of both trees of other node for node,
+    // so no comparator is called.
     void copy(bimap const& other) {
-        for (auto it = other.begin_left(); it != other.end_left(); it++) {
-            auto* ptr = static_cast<bi_node*>(it.it_node);
-            insert(ptr->l_node::get_value(), ptr->r_node::get_value());
+        clone_map<bi_node> cloned(other.size() + 1);
+        auto* other_end = static_cast<bi_node const*>(other.l_tree.get_end());
+        auto* end = static_cast<bi_node*>(l_tree.get_end());
+        static_cast<priority&>(*end) = *other_end;
+        cloned.put(other_end, end);
+        try {
+            for (auto it = other.begin_left(); it != other.end_left(); it++) {
+                auto* ptr = static_cast<bi_node const*>(it.it_node);
+                cloned.put(ptr, create_node(static_cast<priority const&>(*ptr), ptr->l_node::get_value(),
+                                            ptr->r_node::get_value()));
+            }
+        } catch (...) {
+            cloned.for_each([&](bi_node const*, bi_node* ptr) {
+                if (ptr != end) {
+                    destroy_node(ptr);
+                }
+            });
+            throw;
+        }
+        auto l_map = [&](l_node const* ptr) -> l_node* {
+            return ptr ? cloned.get(static_cast<bi_node const*>(ptr)) : nullptr;
+        };
+        auto r_map = [&](r_node const* ptr) -> r_node* {
+            return ptr ? cloned.get(static_cast<bi_node const*>(ptr)) : nullptr;
+        };
+        cloned.for_each([&](bi_node const* from, bi_node* to) {
+            decltype(l_tree)::clone_links(from, to, l_map);
+            decltype(r_tree)::clone_links(from, to, r_map);
+        });
+        l_tree.clone(other.l_tree, l_map);
+        r_tree.clone(other.r_tree, r_map);
+        bimap_size = other.size();
+    }
+
+    // The range is cut out of `tree` with two splits; its nodes are unlinked
+    // from `other` one by one while the detached subtree is torn down. Merging
+    // the children of a treap node takes expected O(1) steps, so this is
+    // O(log n + k) in total. Counted trees would pay O(log n) per node to fix
+    // sizes, so past roughly n / log n nodes they are recounted once instead.
+    template<typename Tree, typename Other>
+    void erase_range(Tree& tree, Other& other, typename Tree::node_t* first, typename Tree::node_t* last) noexcept {
+        bool recount = false;
+        if constexpr (OrderStatistics) {
+            std::size_t depth = 1;
+            while ((std::size_t(1) << depth) < bimap_size) {
+                depth++;
+            }
+            recount = (Tree::index_of(last) - Tree::index_of(first)) * depth > bimap_size;
+        }
+        tree.erase_range(first, last, [this, &other, recount](bi_node* ptr) {
+            if (recount) {
+                other.template erase<false>(ptr);
+            } else {
+                other.erase(ptr);
+            }
+            destroy_node(ptr);
+            bimap_size--;
+        });
+        if (recount) {
+            other.recount();
         }
     }
 
@@ -667,16 +2433,2106 @@ private:
         bimap_size--;
         l_tree.erase(ptr);
         r_tree.erase(ptr);
-        delete ptr;
+        destroy_node(ptr);
     }
 
-    void insert(bi_node* const& new_elem) noexcept {
-        bimap_size++;
-        l_tree.insert(new_elem);
-        r_tree.insert(new_elem);
+    node_allocator alloc;
+    tree<Left, left_tag, CompareLeft, bi_node> l_tree;
+    tree<Right, right_tag, CompareRight, bi_node> r_tree;
+    std::size_t bimap_size;
+};
+
+namespace {
+    // Counts the readers inside a section over slots on separate cache lines,
+    // so readers on different cores do not contend on one counter.
+    struct read_indicator {
+        void arrive() noexcept {
+            slots[slot()].count.fetch_add(1);
+        }
+
+        void depart() noexcept {
+            slots[slot()].count.fetch_sub(1);
+        }
+
+        bool empty() const noexcept {
+            for (auto const& s : slots) {
+                if (s.count.load() != 0) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    private:
+        static constexpr std::size_t slot_count = 64;
+
+        struct alignas(64) counter {
+            std::atomic<std::int64_t> count{0};
+        };
+
+        static std::size_t slot() noexcept {
+            static std::atomic<std::size_t> next{0};
+            thread_local std::size_t res = next.fetch_add(1, std::memory_order_relaxed) % slot_count;
+            return res;
+        }
+
+        std::array<counter, slot_count> slots;
+    };
+}
+
+// A bimap shared by many readers and one writer at a time, kept as two
+// copies with the left-right technique: readers go to the copy the writer
+// is not touching, so lookups are wait-free and never block. A write is
+// applied to the idle copy, readers are switched over to it, and once the
+// ones still on the old copy have left, it is applied there too. Writes thus
+// cost twice as much and must be deterministic.
+template <typename Left, typename Right,
+        typename CompareLeft = std::less<Left>,
+        typename CompareRight = std::less<Right>,
+        typename Allocator = std::allocator<std::pair<Left, Right>>>
+struct concurrent_bimap {
+    using bimap_t = bimap<Left, Right, CompareLeft, CompareRight, Allocator>;
+
+    concurrent_bimap() = default;
+
+    explicit concurrent_bimap(bimap_t const& init) : copies{init, init} {}
+
+    concurrent_bimap(concurrent_bimap const&) = delete;
+    concurrent_bimap& operator=(concurrent_bimap const&) = delete;
+
+    // Calls f with a consistent view of the bimap. Nothing f obtains from it
+    // may be used after f returns.
+    template<typename F>
+    decltype(auto) read(F&& f) const {
+        std::size_t version = version_index.load();
+        indicators[version].arrive();
+        struct leave {
+            read_indicator& indicator;
+            ~leave() {
+                indicator.depart();
+            }
+        } guard{indicators[version]};
+        return f(static_cast<bimap_t const&>(copies[reading.load()]));
     }
 
-    tree<Left, left_tag, CompareLeft> l_tree;
-    tree<Right, right_tag, CompareRight> r_tree;
-    std::size_t bimap_size;
+    // Applies f to both copies and returns what it returned for the first.
+    // If f throws, the copy it threw on is replaced with a copy of the other
+    // one and the exception is rethrown: a throw on the first copy leaves the
+    // bimap unchanged, a throw on the second leaves the write applied. If
+    // that copy cannot be made, std::terminate is called, as the two copies
+    // would otherwise diverge.
+    template<typename F>
+    auto write(F&& f) {
+        std::lock_guard<std::mutex> lock(writer);
+        std::size_t current = reading.load();
+        auto apply = [&](std::size_t target) -> decltype(auto) {
+            try {
+                return f(copies[target]);
+            } catch (...) {
+                resync(target);
+                throw;
+            }
+        };
+        if constexpr (std::is_void_v<std::invoke_result_t<F&, bimap_t&>>) {
+            apply(1 - current);
+            reading.store(1 - current);
+            wait_for_readers();
+            apply(current);
+        } else {
+            auto res = apply(1 - current);
+            reading.store(1 - current);
+            wait_for_readers();
+            apply(current);
+            return res;
+        }
+    }
+
+    std::optional<Right> find_left(Left const& left) const {
+        return read([&](bimap_t const& b) -> std::optional<Right> {
+            auto it = b.find_left(left);
+            return it != b.end_left() ? std::optional<Right>(*it.flip()) : std::nullopt;
+        });
+    }
+
+    std::optional<Left> find_right(Right const& right) const {
+        return read([&](bimap_t const& b) -> std::optional<Left> {
+            auto it = b.find_right(right);
+            return it != b.end_right() ? std::optional<Left>(*it.flip()) : std::nullopt;
+        });
+    }
+
+    Right at_left(Left const& left) const {
+        return read([&](bimap_t const& b) { return b.at_left(left); });
+    }
+
+    Left at_right(Right const& right) const {
+        return read([&](bimap_t const& b) { return b.at_right(right); });
+    }
+
+    std::size_t size() const {
+        return read([](bimap_t const& b) { return b.size(); });
+    }
+
+    bool insert(Left const& left, Right const& right) {
+        return write([&](bimap_t& b) { return b.insert(left, right) != b.end_left(); });
+    }
+
+    bool erase_left(Left const& left) {
+        return write([&](bimap_t& b) { return b.erase_left(left); });
+    }
+
+    bool erase_right(Right const& right) {
+        return write([&](bimap_t& b) { return b.erase_right(right); });
+    }
+
+private:
+    // Only the writer touches copies[target], and readers of the other copy
+    // only read it, so it can be copied from while they run.
+    void resync(std::size_t target) noexcept {
+        copies[target] = copies[1 - target];
+    }
+
+    // Readers that arrived under the current version may still be on the
+    // copy about to be written. Toggling the version and draining both
+    // indicators in turn ensures they have all left without ever making a
+    // reader wait.
+    void wait_for_readers() {
+        std::size_t prev = version_index.load();
+        std::size_t next = 1 - prev;
+        while (!indicators[next].empty()) {
+            std::this_thread::yield();
+        }
+        version_index.store(next);
+        while (!indicators[prev].empty()) {
+            std::this_thread::yield();
+        }
+    }
+
+    std::array<bimap_t, 2> copies;
+    mutable std::array<read_indicator, 2> indicators;
+    std::atomic<std::size_t> version_index{0};
+    std::atomic<std::size_t> reading{0};
+    std::mutex writer;
+};
+
+namespace {
+    template<typename Left, typename Right>
+    struct shared_pair {
+        template<typename L, typename R>
+        shared_pair(L&& left, R&& right) : left(std::forward<L>(left)), right(std::forward<R>(right)) {}
+
+        mutable std::atomic<std::size_t> refs{0};
+        Left left;
+        Right right;
+    };
+
+    // A node of a persistent treap. Once published, a node is never changed,
+    // so versions share every subtree they have in common.
+    template<typename Pair>
+    struct persistent_node : priority {
+        persistent_node(priority const& prio, Pair const* value, persistent_node const* left,
+                        persistent_node const* right) noexcept
+            : priority(prio), left(left), right(right), value(value) {
+            value->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        mutable std::atomic<std::size_t> refs{1};
+        persistent_node const* left;
+        persistent_node const* right;
+        Pair const* value;
+    };
+
+    // The split and merge of tree, with path copying instead of relinking:
+    // every function leaves its arguments intact and returns a new reference.
+    template<typename Pair, typename Key, Key Pair::*Field, typename Comp>
+    struct persistent_tree {
+        using node_t = persistent_node<Pair>;
+
+        // Owns one reference to a node until it is handed over, so copies made
+        // on a path are released if a comparator or an allocation throws.
+        struct node_ref {
+            node_ref() noexcept : t(nullptr) {}
+
+            explicit node_ref(node_t const* t) noexcept : t(t) {}
+
+            node_ref(node_ref&& other) noexcept : t(std::exchange(other.t, nullptr)) {}
+
+            node_ref& operator=(node_ref&&) = delete;
+
+            ~node_ref() {
+                persistent_tree::release(t);
+            }
+
+            node_t const* get() const noexcept {
+                return t;
+            }
+
+            node_t const* release() noexcept {
+                return std::exchange(t, nullptr);
+            }
+
+        private:
+            node_t const* t;
+        };
+
+        using ref_pair = std::pair<node_ref, node_ref>;
+
+        static Key const& key(node_t const* t) noexcept {
+            return t->value->*Field;
+        }
+
+        static node_t const* retain(node_t const* t) noexcept {
+            if (t) {
+                t->refs.fetch_add(1, std::memory_order_relaxed);
+            }
+            return t;
+        }
+
+        static void release(node_t const* t) noexcept {
+            while (t && t->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                release(t->left);
+                node_t const* right = t->right;
+                release(t->value);
+                delete t;
+                t = right;
+            }
+        }
+
+        static node_t const* find(Comp const& comp, node_t const* t, Key const& val) {
+            while (t) {
+                if (comp(val, key(t))) {
+                    t = t->left;
+                } else if (comp(key(t), val)) {
+                    t = t->right;
+                } else {
+                    return t;
+                }
+            }
+            return nullptr;
+        }
+
+        // Adds a node for value with priority prio; its key must be absent
+        // from t. The node is created where it lands, with its children.
+        static node_ref insert(Comp const& comp, node_t const* t, priority const& prio, Pair const* value) {
+            if (!t || prio.get_priority() < t->get_priority()) {
+                ref_pair parts = split(comp, t, value->*Field);
+                return make(prio, value, std::move(parts.first), std::move(parts.second));
+            }
+            if (comp(value->*Field, key(t))) {
+                node_ref left = insert(comp, t->left, prio, value);
+                return make(*t, t->value, std::move(left), node_ref(retain(t->right)));
+            }
+            node_ref right = insert(comp, t->right, prio, value);
+            return make(*t, t->value, node_ref(retain(t->left)), std::move(right));
+        }
+
+        // The key must be present in t.
+        static node_ref erase(Comp const& comp, node_t const* t, Key const& val) {
+            if (comp(val, key(t))) {
+                node_ref left = erase(comp, t->left, val);
+                return make(*t, t->value, std::move(left), node_ref(retain(t->right)));
+            }
+            if (comp(key(t), val)) {
+                node_ref right = erase(comp, t->right, val);
+                return make(*t, t->value, node_ref(retain(t->left)), std::move(right));
+            }
+            return merge(t->left, t->right);
+        }
+
+        static ref_pair split(Comp const& comp, node_t const* t, Key const& val) {
+            if (!t) {
+                return {};
+            }
+            if (comp(key(t), val)) {
+                ref_pair parts = split(comp, t->right, val);
+                return {make(*t, t->value, node_ref(retain(t->left)), std::move(parts.first)), std::move(parts.second)};
+            }
+            ref_pair parts = split(comp, t->left, val);
+            return {std::move(parts.first), make(*t, t->value, std::move(parts.second), node_ref(retain(t->right)))};
+        }
+
+        static node_ref merge(node_t const* l, node_t const* r) {
+            if (!l || !r) {
+                return node_ref(retain(l ? l : r));
+            }
+            if (l->get_priority() < r->get_priority()) {
+                node_ref right = merge(l->right, r);
+                return make(*l, l->value, node_ref(retain(l->left)), std::move(right));
+            }
+            node_ref left = merge(l, r->left);
+            return make(*r, r->value, std::move(left), node_ref(retain(r->right)));
+        }
+
+        template<typename F>
+        static void for_each(node_t const* t, F& f) {
+            while (t) {
+                for_each(t->left, f);
+                f(*t->value);
+                t = t->right;
+            }
+        }
+
+    private:
+        // A node with the given priority and value, taking over the children.
+        static node_ref make(priority const& prio, Pair const* value, node_ref left, node_ref right) {
+            node_ref res(new node_t(prio, value, left.get(), right.get()));
+            left.release();
+            right.release();
+            return res;
+        }
+
+        static void release(Pair const* value) noexcept {
+            if (value->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                delete value;
+            }
+        }
+    };
+}
+
+// An immutable bimap. Updates return a new version that shares all but
+// O(log n) nodes with the old one, and copying a version is O(1). Versions
+// may be handed to other threads: nodes are reference counted atomically
+// and never change once shared.
+template <typename Left, typename Right,
+        typename CompareLeft = std::less<Left>,
+        typename CompareRight = std::less<Right>>
+struct persistent_bimap {
+    persistent_bimap(CompareLeft cmpL = CompareLeft(), CompareRight cmpR = CompareRight()) noexcept
+        : l_comp(std::move(cmpL)), r_comp(std::move(cmpR)) {}
+
+    persistent_bimap(persistent_bimap const& other) noexcept
+        : l_comp(other.l_comp), r_comp(other.r_comp), l_root(l_tree::retain(other.l_root)),
+          r_root(r_tree::retain(other.r_root)), bimap_size(other.bimap_size) {}
+
+    persistent_bimap(persistent_bimap&& other) noexcept
+        : l_comp(other.l_comp), r_comp(other.r_comp), l_root(std::exchange(other.l_root, nullptr)),
+          r_root(std::exchange(other.r_root, nullptr)), bimap_size(std::exchange(other.bimap_size, 0)) {}
+
+    persistent_bimap& operator=(persistent_bimap other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    ~persistent_bimap() {
+        l_tree::release(l_root);
+        r_tree::release(r_root);
+    }
+
+    // Returns this version if either key is already present.
+    persistent_bimap insert(Left left, Right right) const {
+        if (find_left(left) || find_right(right)) {
+            return *this;
+        }
+        // value keeps a reference of its own until both nodes hold one.
+        std::unique_ptr<pair_t> value(new pair_t(std::move(left), std::move(right)));
+        value->refs.store(1, std::memory_order_relaxed);
+        typename l_tree::node_ref l_new = l_tree::insert(l_comp, l_root, priority(), value.get());
+        typename r_tree::node_ref r_new = r_tree::insert(r_comp, r_root, priority(), value.get());
+        value.release()->refs.fetch_sub(1, std::memory_order_relaxed);
+        persistent_bimap res(l_comp, r_comp);
+        res.l_root = l_new.release();
+        res.r_root = r_new.release();
+        res.bimap_size = bimap_size + 1;
+        return res;
+    }
+
+    persistent_bimap erase_left(Left const& left) const {
+        Right const* right = find_left(left);
+        return right ? erase(left, *right) : *this;
+    }
+
+    persistent_bimap erase_right(Right const& right) const {
+        Left const* left = find_right(right);
+        return left ? erase(*left, right) : *this;
+    }
+
+    // The returned pointers stay valid as long as this version exists.
+    Right const* find_left(Left const& left) const {
+        auto* t = l_tree::find(l_comp, l_root, left);
+        return t ? &t->value->right : nullptr;
+    }
+
+    Left const* find_right(Right const& right) const {
+        auto* t = r_tree::find(r_comp, r_root, right);
+        return t ? &t->value->left : nullptr;
+    }
+
+    Right const& at_left(Left const& left) const {
+        Right const* res = find_left(left);
+        if (!res) {
+            throw std::out_of_range("No such key in bimap");
+        }
+        return *res;
+    }
+
+    Left const& at_right(Right const& right) const {
+        Left const* res = find_right(right);
+        if (!res) {
+            throw std::out_of_range("No such key in bimap");
+        }
+        return *res;
+    }
+
+    // Calls f(left, right) for every pair in left order.
+    template<typename F>
+    void for_each(F&& f) const {
+        auto call = [&f](pair_t const& p) { f(p.left, p.right); };
+        l_tree::for_each(l_root, call);
+    }
+
+    bool empty() const noexcept {
+        return bimap_size == 0;
+    }
+
+    std::size_t size() const noexcept {
+        return bimap_size;
+    }
+
+    void swap(persistent_bimap& other) noexcept {
+        std::swap(l_comp, other.l_comp);
+        std::swap(r_comp, other.r_comp);
+        std::swap(l_root, other.l_root);
+        std::swap(r_root, other.r_root);
+        std::swap(bimap_size, other.bimap_size);
+    }
+
+private:
+    using pair_t = shared_pair<Left, Right>;
+    using node_t = persistent_node<pair_t>;
+    using l_tree = persistent_tree<pair_t, Left, &pair_t::left, CompareLeft>;
+    using r_tree = persistent_tree<pair_t, Right, &pair_t::right, CompareRight>;
+
+    persistent_bimap erase(Left const& left, Right const& right) const {
+        typename l_tree::node_ref l_new = l_tree::erase(l_comp, l_root, left);
+        typename r_tree::node_ref r_new = r_tree::erase(r_comp, r_root, right);
+        persistent_bimap res(l_comp, r_comp);
+        res.l_root = l_new.release();
+        res.r_root = r_new.release();
+        res.bimap_size = bimap_size - 1;
+        return res;
+    }
+
+    CompareLeft l_comp;
+    CompareRight r_comp;
+    typename l_tree::node_t const* l_root = nullptr;
+    typename r_tree::node_t const* r_root = nullptr;
+    std::size_t bimap_size = 0;
+};
+
+namespace {
+    // Open addressing with linear probing over indices of a dense array. A
+    // slot keeps the top 32 bits of the mixed hash next to its index, which
+    // spares most key comparisons and lets the table grow without hashing
+    // the keys again.
+    struct hash_slots {
+        static constexpr std::uint32_t none = UINT32_MAX;
+
+        static std::uint32_t mix(std::size_t hash) noexcept {
+            return static_cast<std::uint32_t>((static_cast<std::uint64_t>(hash) * 0x9e3779b97f4a7c15ull) >> 32);
+        }
+
+        // Returns the index for which match holds, or none.
+        template<typename Match>
+        std::uint32_t find(std::uint32_t hash, Match&& match) const {
+            if (slots.empty()) {
+                return none;
+            }
+            for (std::size_t i = home(hash);; i = (i + 1) & mask()) {
+                slot const& s = slots[i];
+                if (s.index == none) {
+                    return none;
+                }
+                if (s.hash == hash && match(s.index)) {
+                    return s.index;
+                }
+            }
+        }
+
+        // Keeps the load at most 1/2.
+        void reserve(std::size_t count) {
+            if (count * 2 <= slots.size()) {
+                return;
+            }
+            std::size_t capacity = std::max<std::size_t>(slots.size() * 2, 16);
+            while (count * 2 > capacity) {
+                capacity *= 2;
+            }
+            std::vector<slot> old(capacity, slot{0, none});
+            old.swap(slots);
+            shift = 32;
+            for (std::size_t c = capacity; c > 1; c /= 2) {
+                shift--;
+            }
+            for (slot s : old) {
+                if (s.index != none) {
+                    insert(s.hash, s.index);
+                }
+            }
+        }
+
+        // The table must have room for one more index, see reserve.
+        void insert(std::uint32_t hash, std::uint32_t index) noexcept {
+            std::size_t i = home(hash);
+            while (slots[i].index != none) {
+                i = (i + 1) & mask();
+            }
+            slots[i] = {hash, index};
+        }
+
+        void replace(std::uint32_t hash, std::uint32_t from, std::uint32_t to) noexcept {
+            slots[position(hash, from)].index = to;
+        }
+
+        // Backward shift deletion: each later slot of the run moves into the
+        // hole unless that would put it before its home, so no tombstones.
+        void erase(std::uint32_t hash, std::uint32_t index) noexcept {
+            std::size_t hole = position(hash, index);
+            for (std::size_t i = (hole + 1) & mask(); slots[i].index != none; i = (i + 1) & mask()) {
+                if (((i - home(slots[i].hash)) & mask()) >= ((i - hole) & mask())) {
+                    slots[hole] = slots[i];
+                    hole = i;
+                }
+            }
+            slots[hole].index = none;
+        }
+
+        void clear() noexcept {
+            std::fill(slots.begin(), slots.end(), slot{0, none});
+        }
+
+    private:
+        struct slot {
+            std::uint32_t hash;
+            std::uint32_t index;
+        };
+
+        std::size_t mask() const noexcept {
+            return slots.size() - 1;
+        }
+
+        std::size_t home(std::uint32_t hash) const noexcept {
+            return hash >> shift;
+        }
+
+        std::size_t position(std::uint32_t hash, std::uint32_t index) const noexcept {
+            std::size_t i = home(hash);
+            while (slots[i].index != index) {
+                i = (i + 1) & mask();
+            }
+            return i;
+        }
+
+        std::vector<slot> slots;
+        unsigned shift = 32;
+    };
+}
+
+// A bimap without ordering for exact lookups in O(1). The pairs are kept in
+// a dense array, which is what iteration walks in no particular order, and
+// each side has a hash table of indices into it. Erasing moves the last pair
+// into the hole, so the iterator to an erased pair then points to the next
+// one to visit. Insertions invalidate iterators. At most 2^32 - 1 pairs.
+template <typename Left, typename Right,
+        typename HashLeft = std::hash<Left>,
+        typename HashRight = std::hash<Right>,
+        typename EqualLeft = std::equal_to<Left>,
+        typename EqualRight = std::equal_to<Right>>
+struct unordered_bimap {
+    using left_t = Left;
+    using right_t = Right;
+
+private:
+    using pair_t = std::pair<Left, Right>;
+
+public:
+    struct left_iterator;
+
+    struct right_iterator {
+        friend struct unordered_bimap;
+
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Right;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Right const*;
+        using reference = Right const&;
+
+        right_iterator() noexcept : ptr(nullptr) {}
+
+        right_iterator(pair_t const* ptr) noexcept : ptr(ptr) {}
+
+        Right const& operator*() const noexcept {
+            return ptr->second;
+        }
+
+        Right const* operator->() const noexcept {
+            return &ptr->second;
+        }
+
+        right_iterator& operator++() noexcept {
+            ++ptr;
+            return *this;
+        }
+
+        right_iterator operator++(int) noexcept {
+            auto old = *this;
+            ++(*this);
+            return old;
+        }
+
+        friend bool operator==(right_iterator const& a, right_iterator const& b) {
+            return a.ptr == b.ptr;
+        }
+
+        friend bool operator!=(right_iterator const& a, right_iterator const& b) {
+            return !(a == b);
+        }
+
+        left_iterator flip() const noexcept {
+            return ptr;
+        }
+
+    private:
+        pair_t const* ptr;
+    };
+
+    struct left_iterator {
+        friend struct unordered_bimap;
+
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Left;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Left const*;
+        using reference = Left const&;
+
+        left_iterator() noexcept : ptr(nullptr) {}
+
+        left_iterator(pair_t const* ptr) noexcept : ptr(ptr) {}
+
+        Left const& operator*() const noexcept {
+            return ptr->first;
+        }
+
+        Left const* operator->() const noexcept {
+            return &ptr->first;
+        }
+
+        left_iterator& operator++() noexcept {
+            ++ptr;
+            return *this;
+        }
+
+        left_iterator operator++(int) noexcept {
+            auto old = *this;
+            ++(*this);
+            return old;
+        }
+
+        friend bool operator==(left_iterator const& a, left_iterator const& b) {
+            return a.ptr == b.ptr;
+        }
+
+        friend bool operator!=(left_iterator const& a, left_iterator const& b) {
+            return !(a == b);
+        }
+
+        right_iterator flip() const noexcept {
+            return ptr;
+        }
+
+    private:
+        pair_t const* ptr;
+    };
+
+    unordered_bimap(HashLeft hashL = HashLeft(), HashRight hashR = HashRight(),
+                    EqualLeft eqL = EqualLeft(), EqualRight eqR = EqualRight())
+        : l_hash(std::move(hashL)), r_hash(std::move(hashR)), l_eq(std::move(eqL)), r_eq(std::move(eqR)) {}
+
+    template<typename InputIt, typename = std::enable_if_t<is_iterator<InputIt>::value>>
+    unordered_bimap(InputIt first, InputIt last, HashLeft hashL = HashLeft(), HashRight hashR = HashRight(),
+                    EqualLeft eqL = EqualLeft(), EqualRight eqR = EqualRight())
+        : unordered_bimap(std::move(hashL), std::move(hashR), std::move(eqL), std::move(eqR)) {
+        for (; first != last; ++first) {
+            auto&& kv = *first;
+            try_insert(std::get<0>(std::forward<decltype(kv)>(kv)), std::get<1>(std::forward<decltype(kv)>(kv)));
+        }
+    }
+
+    left_iterator insert(Left const& l_val, Right const& r_val) {
+        auto res = try_insert(l_val, r_val);
+        return res.second ? res.first : end_left();
+    }
+
+    left_iterator insert(Left&& l_val, Right const& r_val) {
+        auto res = try_insert(std::move(l_val), r_val);
+        return res.second ? res.first : end_left();
+    }
+
+    left_iterator insert(Left const& l_val, Right&& r_val) {
+        auto res = try_insert(l_val, std::move(r_val));
+        return res.second ? res.first : end_left();
+    }
+
+    left_iterator insert(Left&& l_val, Right&& r_val) {
+        auto res = try_insert(std::move(l_val), std::move(r_val));
+        return res.second ? res.first : end_left();
+    }
+
+    template<typename L = Left, typename R = Right,
+            typename = std::enable_if_t<std::is_same_v<std::decay_t<L>, Left> && std::is_same_v<std::decay_t<R>, Right>>>
+    std::pair<left_iterator, bool> try_insert(L&& l_val, R&& r_val) {
+        std::uint32_t l_code = l_hash_of(l_val);
+        std::uint32_t found = l_find(l_code, l_val);
+        if (found != hash_slots::none) {
+            return {&pairs[found], false};
+        }
+        std::uint32_t r_code = r_hash_of(r_val);
+        found = r_find(r_code, r_val);
+        if (found != hash_slots::none) {
+            return {&pairs[found], false};
+        }
+        if (pairs.size() == hash_slots::none) {
+            throw std::length_error("unordered_bimap is full");
+        }
+        l_slots.reserve(pairs.size() + 1);
+        r_slots.reserve(pairs.size() + 1);
+        codes.push_back({l_code, r_code});
+        try {
+            pairs.emplace_back(std::forward<L>(l_val), std::forward<R>(r_val));
+        } catch (...) {
+            codes.pop_back();
+            throw;
+        }
+        auto index = static_cast<std::uint32_t>(pairs.size() - 1);
+        l_slots.insert(l_code, index);
+        r_slots.insert(r_code, index);
+        return {&pairs.back(), true};
+    }
+
+    void reserve(std::size_t count) {
+        pairs.reserve(count);
+        codes.reserve(count);
+        l_slots.reserve(count);
+        r_slots.reserve(count);
+    }
+
+    left_iterator erase_left(left_iterator it) {
+        erase(index_of(it.ptr));
+        return it;
+    }
+
+    bool erase_left(Left const& left) {
+        std::uint32_t found = l_find(l_hash_of(left), left);
+        if (found != hash_slots::none) {
+            erase(found);
+        }
+        return found != hash_slots::none;
+    }
+
+    right_iterator erase_right(right_iterator it) {
+        erase(index_of(it.ptr));
+        return it;
+    }
+
+    bool erase_right(Right const& right) {
+        std::uint32_t found = r_find(r_hash_of(right), right);
+        if (found != hash_slots::none) {
+            erase(found);
+        }
+        return found != hash_slots::none;
+    }
+
+    left_iterator find_left(Left const& left) const {
+        std::uint32_t found = l_find(l_hash_of(left), left);
+        return found != hash_slots::none ? left_iterator(&pairs[found]) : end_left();
+    }
+
+    right_iterator find_right(Right const& right) const {
+        std::uint32_t found = r_find(r_hash_of(right), right);
+        return found != hash_slots::none ? right_iterator(&pairs[found]) : end_right();
+    }
+
+    Right const& at_left(Left const& key) const {
+        auto it = find_left(key);
+        if (it == end_left()) {
+            throw std::out_of_range("No such key in bimap");
+        }
+        return *it.flip();
+    }
+
+    Left const& at_right(Right const& key) const {
+        auto it = find_right(key);
+        if (it == end_right()) {
+            throw std::out_of_range("No such key in bimap");
+        }
+        return *it.flip();
+    }
+
+    template<typename U = Right, typename = std::enable_if_t<std::is_default_constructible_v<U>>>
+    Right const& at_left_or_default(Left const& key) {
+        auto it = find_left(key);
+        if (it != end_left()) {
+            return *it.flip();
+        }
+        Right def = Right();
+        erase_right(def);
+        return *insert(key, std::move(def)).flip();
+    }
+
+    template<typename U = Left, typename = std::enable_if_t<std::is_default_constructible_v<U>>>
+    Left const& at_right_or_default(Right const& key) {
+        auto it = find_right(key);
+        if (it != end_right()) {
+            return *it.flip();
+        }
+        Left def = Left();
+        erase_left(def);
+        return *insert(std::move(def), key);
+    }
+
+    left_iterator begin_left() const noexcept {
+        return pairs.data();
+    }
+
+    left_iterator end_left() const noexcept {
+        return pairs.data() + pairs.size();
+    }
+
+    right_iterator begin_right() const noexcept {
+        return pairs.data();
+    }
+
+    right_iterator end_right() const noexcept {
+        return pairs.data() + pairs.size();
+    }
+
+    bool empty() const noexcept {
+        return pairs.empty();
+    }
+
+    std::size_t size() const noexcept {
+        return pairs.size();
+    }
+
+    void clear() noexcept {
+        pairs.clear();
+        codes.clear();
+        l_slots.clear();
+        r_slots.clear();
+    }
+
+    friend bool operator==(unordered_bimap const& a, unordered_bimap const& b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (pair_t const& p : a.pairs) {
+            auto it = b.find_left(p.first);
+            if (it == b.end_left() || !a.r_eq(*it.flip(), p.second)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    friend bool operator!=(unordered_bimap const& a, unordered_bimap const& b) {
+        return !(a == b);
+    }
+
+    void swap(unordered_bimap& other) noexcept {
+        std::swap(l_hash, other.l_hash);
+        std::swap(r_hash, other.r_hash);
+        std::swap(l_eq, other.l_eq);
+        std::swap(r_eq, other.r_eq);
+        pairs.swap(other.pairs);
+        codes.swap(other.codes);
+        std::swap(l_slots, other.l_slots);
+        std::swap(r_slots, other.r_slots);
+    }
+
+private:
+    std::uint32_t l_hash_of(Left const& left) const {
+        return hash_slots::mix(l_hash(left));
+    }
+
+    std::uint32_t r_hash_of(Right const& right) const {
+        return hash_slots::mix(r_hash(right));
+    }
+
+    std::uint32_t l_find(std::uint32_t code, Left const& left) const {
+        return l_slots.find(code, [&](std::uint32_t i) { return l_eq(pairs[i].first, left); });
+    }
+
+    std::uint32_t r_find(std::uint32_t code, Right const& right) const {
+        return r_slots.find(code, [&](std::uint32_t i) { return r_eq(pairs[i].second, right); });
+    }
+
+    std::uint32_t index_of(pair_t const* ptr) const noexcept {
+        return static_cast<std::uint32_t>(ptr - pairs.data());
+    }
+
+    void erase(std::uint32_t index) {
+        l_slots.erase(codes[index].first, index);
+        r_slots.erase(codes[index].second, index);
+        auto last = static_cast<std::uint32_t>(pairs.size() - 1);
+        if (index != last) {
+            l_slots.replace(codes[last].first, last, index);
+            r_slots.replace(codes[last].second, last, index);
+            pairs[index] = std::move(pairs[last]);
+            codes[index] = codes[last];
+        }
+        pairs.pop_back();
+        codes.pop_back();
+    }
+
+    HashLeft l_hash;
+    HashRight r_hash;
+    EqualLeft l_eq;
+    EqualRight r_eq;
+    std::vector<pair_t> pairs;
+    // The mixed hashes of the keys of each pair, so erasing does not call
+    // the hashers.
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> codes;
+    hash_slots l_slots;
+    hash_slots r_slots;
+};
+
+// A bimap whose nodes live in one vector and link to each other with 32-bit
+// indices, so a node of bimap<int, int> takes 36 bytes instead of 72 and
+// the whole structure can be moved or copied as plain memory. Erasing moves
+// the last node into the freed place, which invalidates iterators to it;
+// insertions invalidate nothing. At most 2^32 - 2 pairs.
+template <typename Left, typename Right,
+        typename CompareLeft = std::less<Left>,
+        typename CompareRight = std::less<Right>>
+struct compact_bimap {
+    using left_t = Left;
+    using right_t = Right;
+
+private:
+    static constexpr std::uint32_t nil = UINT32_MAX;
+
+    // A key next to its links, the two children and the parent, so a
+    // descent in one tree touches a single small block per node.
+    template<typename T>
+    struct half {
+        T key;
+        std::uint32_t links[3];
+    };
+
+    struct entry : priority {
+        template<typename L, typename R>
+        entry(L&& l_val, R&& r_val) : left{std::forward<L>(l_val), {}}, right{std::forward<R>(r_val), {}} {}
+
+        half<Left> left;
+        half<Right> right;
+    };
+
+    // Where a key is, or where it would be attached.
+    struct position {
+        std::uint32_t found;
+        std::uint32_t parent;
+        int dir;
+    };
+
+    template<int Side>
+    struct side_iterator {
+        friend struct compact_bimap;
+
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = std::conditional_t<Side == 0, Left, Right>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<Side == 0, Left, Right> const*;
+        using reference = std::conditional_t<Side == 0, Left, Right> const&;
+
+        side_iterator() noexcept : owner(nullptr), index(0) {}
+
+        side_iterator(compact_bimap const* owner, std::uint32_t index) noexcept : owner(owner), index(index) {}
+
+        auto const& operator*() const noexcept {
+            return owner->template key_of<Side>(index);
+        }
+
+        auto const* operator->() const noexcept {
+            return &**this;
+        }
+
+        side_iterator& operator++() noexcept {
+            index = owner->template next<Side>(index);
+            return *this;
+        }
+
+        side_iterator operator++(int) noexcept {
+            auto old = *this;
+            ++(*this);
+            return old;
+        }
+
+        side_iterator& operator--() noexcept {
+            index = owner->template prev<Side>(index);
+            return *this;
+        }
+
+        side_iterator operator--(int) noexcept {
+            auto old = *this;
+            --(*this);
+            return old;
+        }
+
+        friend bool operator==(side_iterator const& a, side_iterator const& b) {
+            return a.index == b.index;
+        }
+
+        friend bool operator!=(side_iterator const& a, side_iterator const& b) {
+            return !(a == b);
+        }
+
+        side_iterator<1 - Side> flip() const noexcept {
+            return {owner, index};
+        }
+
+    private:
+        compact_bimap const* owner;
+        std::uint32_t index;
+    };
+
+public:
+    using left_iterator = side_iterator<0>;
+    using right_iterator = side_iterator<1>;
+
+    compact_bimap(CompareLeft cmpL = CompareLeft(), CompareRight cmpR = CompareRight())
+        : l_comp(std::move(cmpL)), r_comp(std::move(cmpR)) {}
+
+    template<typename InputIt, typename = std::enable_if_t<is_iterator<InputIt>::value>>
+    compact_bimap(InputIt first, InputIt last, CompareLeft cmpL = CompareLeft(), CompareRight cmpR = CompareRight())
+        : compact_bimap(std::move(cmpL), std::move(cmpR)) {
+        for (; first != last; ++first) {
+            try_insert(first->first, first->second);
+        }
+    }
+
+    // Copies keep the indices, so the iterators of one are not valid in the
+    // other even though they would point to equal pairs.
+    compact_bimap(compact_bimap const& other) = default;
+
+    compact_bimap(compact_bimap&& other) noexcept
+        : l_comp(other.l_comp), r_comp(other.r_comp), entries(std::move(other.entries)), roots(other.roots) {
+        other.entries.clear();
+        other.roots = {nil, nil};
+    }
+
+    compact_bimap& operator=(compact_bimap const& other) {
+        if (this != &other) {
+            compact_bimap safe(other);
+            swap(safe);
+        }
+        return *this;
+    }
+
+    compact_bimap& operator=(compact_bimap&& other) noexcept {
+        if (this != &other) {
+            compact_bimap safe(std::move(other));
+            swap(safe);
+        }
+        return *this;
+    }
+
+    left_iterator insert(Left const& l_val, Right const& r_val) {
+        auto res = try_insert(l_val, r_val);
+        return res.second ? res.first : end_left();
+    }
+
+    left_iterator insert(Left&& l_val, Right const& r_val) {
+        auto res = try_insert(std::move(l_val), r_val);
+        return res.second ? res.first : end_left();
+    }
+
+    left_iterator insert(Left const& l_val, Right&& r_val) {
+        auto res = try_insert(l_val, std::move(r_val));
+        return res.second ? res.first : end_left();
+    }
+
+    left_iterator insert(Left&& l_val, Right&& r_val) {
+        auto res = try_insert(std::move(l_val), std::move(r_val));
+        return res.second ? res.first : end_left();
+    }
+
+    template<typename L = Left, typename R = Right,
+            typename = std::enable_if_t<std::is_same_v<std::decay_t<L>, Left> && std::is_same_v<std::decay_t<R>, Right>>>
+    std::pair<left_iterator, bool> try_insert(L&& l_val, R&& r_val) {
+        position l_pos = locate<0>(l_val);
+        if (l_pos.found != nil) {
+            return {{this, l_pos.found}, false};
+        }
+        position r_pos = locate<1>(r_val);
+        if (r_pos.found != nil) {
+            return {{this, r_pos.found}, false};
+        }
+        if (entries.size() == nil - 1) {
+            throw std::length_error("compact_bimap is full");
+        }
+        entries.emplace_back(std::forward<L>(l_val), std::forward<R>(r_val));
+        auto index = static_cast<std::uint32_t>(entries.size() - 1);
+        attach<0>(index, l_pos);
+        attach<1>(index, r_pos);
+        return {{this, index}, true};
+    }
+
+    void reserve(std::size_t count) {
+        entries.reserve(count);
+    }
+
+    left_iterator erase_left(left_iterator it) {
+        return {this, erase_at<0>(it.index)};
+    }
+
+    bool erase_left(Left const& left) {
+        std::uint32_t found = find<0>(left);
+        if (found != nil) {
+            erase(found);
+        }
+        return found != nil;
+    }
+
+    right_iterator erase_right(right_iterator it) {
+        return {this, erase_at<1>(it.index)};
+    }
+
+    bool erase_right(Right const& right) {
+        std::uint32_t found = find<1>(right);
+        if (found != nil) {
+            erase(found);
+        }
+        return found != nil;
+    }
+
+    left_iterator find_left(Left const& left) const {
+        return {this, find<0>(left)};
+    }
+
+    right_iterator find_right(Right const& right) const {
+        return {this, find<1>(right)};
+    }
+
+    Right const& at_left(Left const& key) const {
+        std::uint32_t found = find<0>(key);
+        if (found == nil) {
+            throw std::out_of_range("No such key in bimap");
+        }
+        return entries[found].right.key;
+    }
+
+    Left const& at_right(Right const& key) const {
+        std::uint32_t found = find<1>(key);
+        if (found == nil) {
+            throw std::out_of_range("No such key in bimap");
+        }
+        return entries[found].left.key;
+    }
+
+    left_iterator lower_bound_left(Left const& left) const {
+        return {this, bound<0, false>(left)};
+    }
+
+    left_iterator upper_bound_left(Left const& left) const {
+        return {this, bound<0, true>(left)};
+    }
+
+    right_iterator lower_bound_right(Right const& right) const {
+        return {this, bound<1, false>(right)};
+    }
+
+    right_iterator upper_bound_right(Right const& right) const {
+        return {this, bound<1, true>(right)};
+    }
+
+    left_iterator begin_left() const noexcept {
+        return {this, extreme<0, 0>(roots[0])};
+    }
+
+    left_iterator end_left() const noexcept {
+        return {this, nil};
+    }
+
+    right_iterator begin_right() const noexcept {
+        return {this, extreme<1, 0>(roots[1])};
+    }
+
+    right_iterator end_right() const noexcept {
+        return {this, nil};
+    }
+
+    bool empty() const noexcept {
+        return entries.empty();
+    }
+
+    std::size_t size() const noexcept {
+        return entries.size();
+    }
+
+    void clear() noexcept {
+        entries.clear();
+        roots = {nil, nil};
+    }
+
+    friend bool operator==(compact_bimap const& a, compact_bimap const& b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (auto it1 = a.begin_left(), it2 = b.begin_left(); it1 != a.end_left(); ++it1, ++it2) {
+            if (a.less<0>(*it1, *it2) || a.less<0>(*it2, *it1) ||
+                a.less<1>(*it1.flip(), *it2.flip()) || a.less<1>(*it2.flip(), *it1.flip())) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    friend bool operator!=(compact_bimap const& a, compact_bimap const& b) {
+        return !(a == b);
+    }
+
+    void swap(compact_bimap& other) noexcept {
+        std::swap(l_comp, other.l_comp);
+        std::swap(r_comp, other.r_comp);
+        entries.swap(other.entries);
+        std::swap(roots, other.roots);
+    }
+
+private:
+    template<int Side>
+    auto& half_of(std::uint32_t i) noexcept {
+        if constexpr (Side == 0) {
+            return entries[i].left;
+        } else {
+            return entries[i].right;
+        }
+    }
+
+    template<int Side>
+    auto const& half_of(std::uint32_t i) const noexcept {
+        if constexpr (Side == 0) {
+            return entries[i].left;
+        } else {
+            return entries[i].right;
+        }
+    }
+
+    template<int Side>
+    auto const& key_of(std::uint32_t i) const noexcept {
+        return half_of<Side>(i).key;
+    }
+
+    template<int Side, typename K>
+    bool less(K const& a, K const& b) const {
+        if constexpr (Side == 0) {
+            return l_comp(a, b);
+        } else {
+            return r_comp(a, b);
+        }
+    }
+
+    template<int Side>
+    std::uint32_t& child(std::uint32_t i, int dir) noexcept {
+        return half_of<Side>(i).links[dir];
+    }
+
+    template<int Side>
+    std::uint32_t child(std::uint32_t i, int dir) const noexcept {
+        return half_of<Side>(i).links[dir];
+    }
+
+    template<int Side>
+    std::uint32_t& up(std::uint32_t i) noexcept {
+        return half_of<Side>(i).links[2];
+    }
+
+    template<int Side>
+    std::uint32_t up(std::uint32_t i) const noexcept {
+        return half_of<Side>(i).links[2];
+    }
+
+    template<int Side, typename K>
+    std::uint32_t find(K const& key) const {
+        std::uint32_t i = roots[Side];
+        while (i != nil) {
+            if (less<Side>(key, key_of<Side>(i))) {
+                i = child<Side>(i, 0);
+            } else if (less<Side>(key_of<Side>(i), key)) {
+                i = child<Side>(i, 1);
+            } else {
+                return i;
+            }
+        }
+        return nil;
+    }
+
+    template<int Side, typename K>
+    position locate(K const& key) const {
+        position res{nil, nil, 0};
+        for (std::uint32_t i = roots[Side]; i != nil; i = child<Side>(i, res.dir)) {
+            if (less<Side>(key, key_of<Side>(i))) {
+                res.dir = 0;
+            } else if (less<Side>(key_of<Side>(i), key)) {
+                res.dir = 1;
+            } else {
+                res.found = i;
+                return res;
+            }
+            res.parent = i;
+        }
+        return res;
+    }
+
+    template<int Side, bool Upper, typename K>
+    std::uint32_t bound(K const& key) const {
+        std::uint32_t res = nil;
+        for (std::uint32_t i = roots[Side]; i != nil;) {
+            bool right = Upper ? !less<Side>(key, key_of<Side>(i)) : less<Side>(key_of<Side>(i), key);
+            if (!right) {
+                res = i;
+            }
+            i = child<Side>(i, right);
+        }
+        return res;
+    }
+
+    // The leftmost (Dir = 0) or rightmost node under i.
+    template<int Side, int Dir>
+    std::uint32_t extreme(std::uint32_t i) const noexcept {
+        if (i == nil) {
+            return nil;
+        }
+        while (child<Side>(i, Dir) != nil) {
+            i = child<Side>(i, Dir);
+        }
+        return i;
+    }
+
+    template<int Side, int Dir>
+    std::uint32_t step(std::uint32_t i) const noexcept {
+        if (child<Side>(i, Dir) != nil) {
+            return extreme<Side, 1 - Dir>(child<Side>(i, Dir));
+        }
+        std::uint32_t p = up<Side>(i);
+        while (p != nil && child<Side>(p, Dir) == i) {
+            i = p;
+            p = up<Side>(p);
+        }
+        return p;
+    }
+
+    template<int Side>
+    std::uint32_t next(std::uint32_t i) const noexcept {
+        return step<Side, 1>(i);
+    }
+
+    template<int Side>
+    std::uint32_t prev(std::uint32_t i) const noexcept {
+        return i == nil ? extreme<Side, 1>(roots[Side]) : step<Side, 0>(i);
+    }
+
+    // Replaces x's link from its parent (or the root) with y.
+    template<int Side>
+    void replace_child(std::uint32_t p, std::uint32_t x, std::uint32_t y) noexcept {
+        if (p == nil) {
+            roots[Side] = y;
+        } else {
+            child<Side>(p, child<Side>(p, 0) == x ? 0 : 1) = y;
+        }
+    }
+
+    template<int Side>
+    void rotate_up(std::uint32_t x) noexcept {
+        std::uint32_t p = up<Side>(x);
+        int dir = child<Side>(p, 0) == x ? 0 : 1;
+        std::uint32_t moved = child<Side>(x, 1 - dir);
+        child<Side>(p, dir) = moved;
+        if (moved != nil) {
+            up<Side>(moved) = p;
+        }
+        replace_child<Side>(up<Side>(p), p, x);
+        up<Side>(x) = up<Side>(p);
+        child<Side>(x, 1 - dir) = p;
+        up<Side>(p) = x;
+    }
+
+    template<int Side>
+    void attach(std::uint32_t x, position const& pos) noexcept {
+        child<Side>(x, 0) = nil;
+        child<Side>(x, 1) = nil;
+        up<Side>(x) = pos.parent;
+        if (pos.parent == nil) {
+            roots[Side] = x;
+        } else {
+            child<Side>(pos.parent, pos.dir) = x;
+        }
+        while (up<Side>(x) != nil && entries[x].get_priority() < entries[up<Side>(x)].get_priority()) {
+            rotate_up<Side>(x);
+        }
+    }
+
+    template<int Side>
+    void detach(std::uint32_t x) noexcept {
+        while (child<Side>(x, 0) != nil && child<Side>(x, 1) != nil) {
+            std::uint32_t l = child<Side>(x, 0), r = child<Side>(x, 1);
+            rotate_up<Side>(entries[l].get_priority() < entries[r].get_priority() ? l : r);
+        }
+        std::uint32_t c = child<Side>(x, 0) != nil ? child<Side>(x, 0) : child<Side>(x, 1);
+        if (c != nil) {
+            up<Side>(c) = up<Side>(x);
+        }
+        replace_child<Side>(up<Side>(x), x, c);
+    }
+
+    // Points the neighbours of node from at its new index to.
+    template<int Side>
+    void relocate(std::uint32_t from, std::uint32_t to) noexcept {
+        replace_child<Side>(up<Side>(from), from, to);
+        for (int dir = 0; dir < 2; dir++) {
+            if (child<Side>(from, dir) != nil) {
+                up<Side>(child<Side>(from, dir)) = to;
+            }
+        }
+    }
+
+    void erase(std::uint32_t x) {
+        detach<0>(x);
+        detach<1>(x);
+        auto last = static_cast<std::uint32_t>(entries.size() - 1);
+        if (x != last) {
+            relocate<0>(last, x);
+            relocate<1>(last, x);
+            entries[x] = std::move(entries[last]);
+        }
+        entries.pop_back();
+    }
+
+    // Returns the index of the node that followed x in Side's order.
+    template<int Side>
+    std::uint32_t erase_at(std::uint32_t x) {
+        std::uint32_t res = next<Side>(x);
+        bool moved = res == entries.size() - 1;
+        erase(x);
+        return moved ? x : res;
+    }
+
+    CompareLeft l_comp;
+    CompareRight r_comp;
+    std::vector<entry> entries;
+    std::array<std::uint32_t, 2> roots{nil, nil};
+};
+
+namespace {
+    inline void prefetch(void const* ptr) noexcept {
+#if defined(__GNUC__)
+        __builtin_prefetch(ptr);
+#else
+        (void) ptr;
+#endif
+    }
+
+    // Slot k (from 1) of the Eytzinger layout has its children at 2k and
+    // 2k + 1. Returns for every rank of a sorted sequence of n keys its slot,
+    // minus one to index a plain array.
+    inline std::vector<std::uint32_t> eytzinger_slots(std::size_t n) {
+        std::vector<std::uint32_t> res(n);
+        std::size_t rank = 0;
+        std::size_t k = 1;
+        while (k <= n && 2 * k <= n) {
+            k *= 2;
+        }
+        for (; k != 0 && rank < n; rank++) {
+            res[rank] = static_cast<std::uint32_t>(k - 1);
+            if (2 * k + 1 <= n) {
+                k = 2 * k + 1;
+                while (2 * k <= n) {
+                    k *= 2;
+                }
+            } else {
+                while (k & 1) {
+                    k >>= 1;
+                }
+                k >>= 1;
+            }
+        }
+        return res;
+    }
+
+    // A frozen file is this header followed by the left keys, the right
+    // keys, the left and the right cross indices, each in slot order and
+    // aligned to 64 bytes. Integers are stored in the native byte order.
+    struct frozen_header {
+        char magic[8];
+        std::uint64_t size;
+        std::uint32_t left_size;
+        std::uint32_t right_size;
+    };
+
+    constexpr char frozen_magic[8] = {'b', 'i', 'm', 'a', 'p', 'f', 'z', '1'};
+
+    struct frozen_layout {
+        std::size_t offsets[4];
+        std::size_t total;
+
+        frozen_layout(std::size_t n, std::size_t left_size, std::size_t right_size) noexcept {
+            std::size_t sizes[4] = {n * left_size, n * right_size, n * sizeof(std::uint32_t), n * sizeof(std::uint32_t)};
+            std::size_t at = align(sizeof(frozen_header));
+            for (int i = 0; i < 4; i++) {
+                offsets[i] = at;
+                at = align(at + sizes[i]);
+            }
+            total = at;
+        }
+
+    private:
+        static std::size_t align(std::size_t x) noexcept {
+            return (x + 63) & ~std::size_t(63);
+        }
+    };
+}
+
+// The queries over the layout of frozen_bimap, on arrays owned elsewhere:
+// by a frozen_bimap itself or by the mapping of a mapped_bimap. Each side's
+// keys are in an implicit Eytzinger array, so the top of the search tree
+// shares a few cache lines and a descent is a branch-free loop that
+// prefetches the keys it will reach a few levels down. Every slot keeps the
+// slot of its pair on the other side, so flip() is a single load.
+template <typename Left, typename Right, typename CompareLeft, typename CompareRight>
+struct frozen_view {
+    using left_t = Left;
+    using right_t = Right;
+
+private:
+    template<int Side>
+    struct side_iterator {
+        friend struct frozen_view;
+
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = std::conditional_t<Side == 0, Left, Right>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = std::conditional_t<Side == 0, Left, Right> const*;
+        using reference = std::conditional_t<Side == 0, Left, Right> const&;
+
+        side_iterator() noexcept : owner(nullptr), k(0) {}
+
+        side_iterator(frozen_view const* owner, std::size_t k) noexcept : owner(owner), k(k) {}
+
+        auto const& operator*() const noexcept {
+            return owner->template keys<Side>()[k - 1];
+        }
+
+        auto const* operator->() const noexcept {
+            return &**this;
+        }
+
+        side_iterator& operator++() noexcept {
+            std::size_t n = owner->size();
+            if (2 * k + 1 <= n) {
+                k = 2 * k + 1;
+                while (2 * k <= n) {
+                    k *= 2;
+                }
+            } else {
+                while (k & 1) {
+                    k >>= 1;
+                }
+                k >>= 1;
+            }
+            return *this;
+        }
+
+        side_iterator operator++(int) noexcept {
+            auto old = *this;
+            ++(*this);
+            return old;
+        }
+
+        side_iterator& operator--() noexcept {
+            std::size_t n = owner->size();
+            if (k == 0) {
+                k = owner->extreme(1);
+            } else if (2 * k <= n) {
+                k = 2 * k;
+                while (2 * k + 1 <= n) {
+                    k = 2 * k + 1;
+                }
+            } else {
+                while (k != 0 && !(k & 1)) {
+                    k >>= 1;
+                }
+                k >>= 1;
+            }
+            return *this;
+        }
+
+        side_iterator operator--(int) noexcept {
+            auto old = *this;
+            --(*this);
+            return old;
+        }
+
+        friend bool operator==(side_iterator const& a, side_iterator const& b) {
+            return a.k == b.k;
+        }
+
+        friend bool operator!=(side_iterator const& a, side_iterator const& b) {
+            return !(a == b);
+        }
+
+        side_iterator<1 - Side> flip() const noexcept {
+            return {owner, owner->template cross<Side>()[k - 1] + std::size_t(1)};
+        }
+
+    private:
+        frozen_view const* owner;
+        // The Eytzinger slot from 1, with 0 past the end.
+        std::size_t k;
+    };
+
+public:
+    using left_iterator = side_iterator<0>;
+    using right_iterator = side_iterator<1>;
+
+    frozen_view(frozen_view const&) = delete;
+    frozen_view& operator=(frozen_view const&) = delete;
+
+    left_iterator find_left(Left const& left) const {
+        return find<0>(left);
+    }
+
+    right_iterator find_right(Right const& right) const {
+        return find<1>(right);
+    }
+
+    Right const& at_left(Left const& key) const {
+        auto it = find_left(key);
+        if (it == end_left()) {
+            throw std::out_of_range("No such key in bimap");
+        }
+        return *it.flip();
+    }
+
+    Left const& at_right(Right const& key) const {
+        auto it = find_right(key);
+        if (it == end_right()) {
+            throw std::out_of_range("No such key in bimap");
+        }
+        return *it.flip();
+    }
+
+    left_iterator lower_bound_left(Left const& left) const {
+        return {this, bound<0, false>(left)};
+    }
+
+    left_iterator upper_bound_left(Left const& left) const {
+        return {this, bound<0, true>(left)};
+    }
+
+    right_iterator lower_bound_right(Right const& right) const {
+        return {this, bound<1, false>(right)};
+    }
+
+    right_iterator upper_bound_right(Right const& right) const {
+        return {this, bound<1, true>(right)};
+    }
+
+    left_iterator begin_left() const noexcept {
+        return {this, extreme(0)};
+    }
+
+    left_iterator end_left() const noexcept {
+        return {this, 0};
+    }
+
+    right_iterator begin_right() const noexcept {
+        return {this, extreme(0)};
+    }
+
+    right_iterator end_right() const noexcept {
+        return {this, 0};
+    }
+
+    bool empty() const noexcept {
+        return n == 0;
+    }
+
+    std::size_t size() const noexcept {
+        return n;
+    }
+
+    // Writes the arrays as they are, to be read back by frozen_bimap::load,
+    // bimap::load or mapped_bimap.
+    void save(std::string const& path) const {
+        static_assert(std::is_trivially_copyable_v<Left> && std::is_trivially_copyable_v<Right>,
+                      "only trivially copyable keys can be saved");
+        frozen_header header{};
+        std::copy(std::begin(frozen_magic), std::end(frozen_magic), header.magic);
+        header.size = n;
+        header.left_size = sizeof(Left);
+        header.right_size = sizeof(Right);
+        frozen_layout layout(n, sizeof(Left), sizeof(Right));
+        char const* parts[4] = {reinterpret_cast<char const*>(l_keys), reinterpret_cast<char const*>(r_keys),
+                                reinterpret_cast<char const*>(l_cross), reinterpret_cast<char const*>(r_cross)};
+        std::size_t ends[4] = {layout.offsets[0] + n * sizeof(Left), layout.offsets[1] + n * sizeof(Right),
+                               layout.offsets[2] + n * sizeof(std::uint32_t), layout.offsets[3] + n * sizeof(std::uint32_t)};
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        std::size_t at = sizeof(header);
+        for (int i = 0; i < 4; i++) {
+            pad(out, layout.offsets[i] - at);
+            out.write(parts[i], static_cast<std::streamsize>(ends[i] - layout.offsets[i]));
+            at = ends[i];
+        }
+        pad(out, layout.total - at);
+        out.close();
+        if (!out) {
+            throw std::runtime_error("Cannot write " + path);
+        }
+    }
+
+protected:
+    template<typename, typename, typename, typename, typename, bool>
+    friend struct bimap;
+
+    // The slot from 1 an iterator is at, 0 past the end.
+    template<int Side>
+    static std::size_t slot(side_iterator<Side> const& it) noexcept {
+        return it.k;
+    }
+
+    frozen_view(CompareLeft cmpL, CompareRight cmpR) : l_comp(std::move(cmpL)), r_comp(std::move(cmpR)) {}
+
+    void point(Left const* l, Right const* r, std::uint32_t const* l_x, std::uint32_t const* r_x, std::size_t size) noexcept {
+        l_keys = l;
+        r_keys = r;
+        l_cross = l_x;
+        r_cross = r_x;
+        n = size;
+    }
+
+    void swap_arrays(frozen_view& other) noexcept {
+        std::swap(l_keys, other.l_keys);
+        std::swap(r_keys, other.r_keys);
+        std::swap(l_cross, other.l_cross);
+        std::swap(r_cross, other.r_cross);
+        std::swap(n, other.n);
+    }
+
+    // Checks the header of a frozen file of the given length and returns its
+    // number of pairs.
+    static std::size_t check(frozen_header const& header, std::size_t length, std::string const& path) {
+        bool valid = std::equal(std::begin(frozen_magic), std::end(frozen_magic), header.magic) &&
+                     header.left_size == sizeof(Left) && header.right_size == sizeof(Right) &&
+                     header.size < std::numeric_limits<std::uint32_t>::max() &&
+                     length >= frozen_layout(header.size, sizeof(Left), sizeof(Right)).total;
+        if (!valid) {
+            throw std::runtime_error(path + " is not a frozen bimap of these key types");
+        }
+        return header.size;
+    }
+
+    // Checks that the cross indices read from a file are inverse
+    // permutations of the slots, so flip() stays in bounds.
+    void check_cross(std::string const& path) const {
+        for (std::size_t k = 0; k < n; k++) {
+            if (l_cross[k] >= n || r_cross[l_cross[k]] != k) {
+                throw std::runtime_error(path + " has corrupted cross indices");
+            }
+        }
+    }
+
+    CompareLeft l_comp;
+    CompareRight r_comp;
+
+private:
+    static void pad(std::ofstream& out, std::size_t count) {
+        for (; count != 0; count--) {
+            out.put('\0');
+        }
+    }
+
+    template<int Side>
+    auto const* keys() const noexcept {
+        if constexpr (Side == 0) {
+            return l_keys;
+        } else {
+            return r_keys;
+        }
+    }
+
+    template<int Side>
+    std::uint32_t const* cross() const noexcept {
+        if constexpr (Side == 0) {
+            return l_cross;
+        } else {
+            return r_cross;
+        }
+    }
+
+    template<int Side, typename K>
+    bool less(K const& a, K const& b) const {
+        if constexpr (Side == 0) {
+            return l_comp(a, b);
+        } else {
+            return r_comp(a, b);
+        }
+    }
+
+    // The first (Dir = 0) or last slot in key order, 0 if empty.
+    std::size_t extreme(int dir) const noexcept {
+        std::size_t k = n == 0 ? 0 : 1;
+        while (k != 0 && 2 * k + dir <= n) {
+            k = 2 * k + dir;
+        }
+        return k;
+    }
+
+    // The descent goes right while the slot's key is before the searched
+    // one, so its path spells the ranks in binary. The answer is the last
+    // slot where it went left: the trailing right turns and that left turn
+    // are shifted out.
+    template<int Side, bool Upper, typename K>
+    std::size_t bound(K const& key) const {
+        auto const* data = keys<Side>();
+        // The descendants of k a cache line of keys further down.
+        constexpr std::size_t ahead = std::max<std::size_t>(1, 64 / sizeof(data[0]));
+        std::size_t k = 1;
+        while (k <= n) {
+            if (ahead * k <= n) {
+                prefetch(data + (ahead * k - 1));
+            }
+            bool right = Upper ? !less<Side>(key, data[k - 1]) : less<Side>(data[k - 1], key);
+            k = 2 * k + right;
+        }
+        std::size_t trailing = 0;
+        while (k & (std::size_t(1) << trailing)) {
+            trailing++;
+        }
+        return k >> (trailing + 1);
+    }
+
+    template<int Side, typename K>
+    side_iterator<Side> find(K const& key) const {
+        std::size_t k = bound<Side, false>(key);
+        if (k != 0 && less<Side>(key, keys<Side>()[k - 1])) {
+            k = 0;
+        }
+        return {this, k};
+    }
+
+    Left const* l_keys = nullptr;
+    Right const* r_keys = nullptr;
+    std::uint32_t const* l_cross = nullptr;
+    std::uint32_t const* r_cross = nullptr;
+    std::size_t n = 0;
+};
+
+// A read-only copy of a bimap for data that is loaded once and then only
+// queried, see frozen_view. Iterators stay valid for the lifetime of the map.
+template <typename Left, typename Right, typename CompareLeft, typename CompareRight>
+struct frozen_bimap : frozen_view<Left, Right, CompareLeft, CompareRight> {
+    // Copies the comparators of source.
+    template<typename Allocator, bool OrderStatistics>
+    explicit frozen_bimap(bimap<Left, Right, CompareLeft, CompareRight, Allocator, OrderStatistics> const& source)
+        : frozen_bimap(source, source.l_tree.comp, source.r_tree.comp) {}
+
+    template<typename Allocator, bool OrderStatistics>
+    frozen_bimap(bimap<Left, Right, CompareLeft, CompareRight, Allocator, OrderStatistics> const& source,
+                 CompareLeft cmpL, CompareRight cmpR)
+        : view(std::move(cmpL), std::move(cmpR)) {
+        std::size_t n = source.size();
+        if (n >= std::numeric_limits<std::uint32_t>::max()) {
+            throw std::length_error("frozen_bimap is limited to 2^32 - 2 pairs");
+        }
+        using source_t = bimap<Left, Right, CompareLeft, CompareRight, Allocator, OrderStatistics>;
+        std::vector<typename source_t::left_iterator> by_left;
+        std::vector<typename source_t::right_iterator> by_right;
+        by_left.reserve(n);
+        by_right.reserve(n);
+        for (auto it = source.begin_left(); it != source.end_left(); ++it) {
+            by_left.push_back(it);
+        }
+        for (auto it = source.begin_right(); it != source.end_right(); ++it) {
+            by_right.push_back(it);
+        }
+        std::vector<std::uint32_t> slots = eytzinger_slots(n);
+        std::vector<std::uint32_t> rank_at(n);
+        for (std::size_t rank = 0; rank < n; rank++) {
+            rank_at[slots[rank]] = static_cast<std::uint32_t>(rank);
+        }
+        l_keys.reserve(n);
+        r_keys.reserve(n);
+        for (std::size_t k = 0; k < n; k++) {
+            l_keys.push_back(*by_left[rank_at[k]]);
+            r_keys.push_back(*by_right[rank_at[k]]);
+        }
+        l_cross.resize(n);
+        r_cross.resize(n);
+        for (std::size_t rank = 0; rank < n; rank++) {
+            auto pos = std::lower_bound(by_right.begin(), by_right.end(), *by_left[rank].flip(),
+                                        [this](auto const& a, Right const& b) { return this->r_comp(*a, b); });
+            std::uint32_t r_slot = slots[pos - by_right.begin()];
+            l_cross[slots[rank]] = r_slot;
+            r_cross[r_slot] = slots[rank];
+        }
+        repoint();
+    }
+
+    frozen_bimap(frozen_bimap const& other)
+        : view(other.l_comp, other.r_comp), l_keys(other.l_keys), r_keys(other.r_keys), l_cross(other.l_cross),
+          r_cross(other.r_cross) {
+        repoint();
+    }
+
+    frozen_bimap(frozen_bimap&& other) noexcept
+        : view(other.l_comp, other.r_comp), l_keys(std::move(other.l_keys)), r_keys(std::move(other.r_keys)),
+          l_cross(std::move(other.l_cross)), r_cross(std::move(other.r_cross)) {
+        repoint();
+        other.repoint();
+    }
+
+    frozen_bimap& operator=(frozen_bimap other) noexcept {
+        std::swap(this->l_comp, other.l_comp);
+        std::swap(this->r_comp, other.r_comp);
+        l_keys.swap(other.l_keys);
+        r_keys.swap(other.r_keys);
+        l_cross.swap(other.l_cross);
+        r_cross.swap(other.r_cross);
+        repoint();
+        return *this;
+    }
+
+    // Reads a file written by save into memory.
+    template<typename L = Left, typename R = Right, typename = std::enable_if_t<is_storable_v<L> && is_storable_v<R>>>
+    static frozen_bimap load(std::string const& path, CompareLeft cmpL = CompareLeft(), CompareRight cmpR = CompareRight()) {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        auto length = static_cast<std::size_t>(in.tellg());
+        frozen_header header{};
+        in.seekg(0);
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+        std::size_t n = view::check(header, in ? length : 0, path);
+        frozen_bimap res(std::move(cmpL), std::move(cmpR));
+        res.l_keys.resize(n);
+        res.r_keys.resize(n);
+        res.l_cross.resize(n);
+        res.r_cross.resize(n);
+        frozen_layout layout(n, sizeof(Left), sizeof(Right));
+        read(in, layout.offsets[0], res.l_keys);
+        read(in, layout.offsets[1], res.r_keys);
+        read(in, layout.offsets[2], res.l_cross);
+        read(in, layout.offsets[3], res.r_cross);
+        if (!in) {
+            throw std::runtime_error("Cannot read " + path);
+        }
+        res.repoint();
+        res.check_cross(path);
+        return res;
+    }
+
+private:
+    using view = frozen_view<Left, Right, CompareLeft, CompareRight>;
+
+    frozen_bimap(CompareLeft cmpL, CompareRight cmpR) : view(std::move(cmpL), std::move(cmpR)) {}
+
+    template<typename T>
+    static void read(std::ifstream& in, std::size_t offset, std::vector<T>& to) {
+        in.seekg(static_cast<std::streamoff>(offset));
+        in.read(reinterpret_cast<char*>(to.data()), static_cast<std::streamsize>(to.size() * sizeof(T)));
+    }
+
+    void repoint() noexcept {
+        this->point(l_keys.data(), r_keys.data(), l_cross.data(), r_cross.data(), l_keys.size());
+    }
+
+    std::vector<Left> l_keys;
+    std::vector<Right> r_keys;
+    std::vector<std::uint32_t> l_cross;
+    std::vector<std::uint32_t> r_cross;
+};
+
+#if __has_include(<sys/mman.h>)
+// A frozen_bimap answered straight from a memory-mapped file written by
+// save: opening it only checks the header and the file size, and the keys
+// and cross indices are paged in as lookups touch them. The cross indices
+// are trusted until validate() has checked them, which reads the whole
+// file. The comparators must order the keys as the ones the file was saved
+// with.
+template <typename Left, typename Right,
+        typename CompareLeft = std::less<Left>,
+        typename CompareRight = std::less<Right>>
+struct mapped_bimap : frozen_view<Left, Right, CompareLeft, CompareRight> {
+    static_assert(std::is_trivially_copyable_v<Left> && std::is_trivially_copyable_v<Right>,
+                  "only trivially copyable keys can be mapped");
+
+    explicit mapped_bimap(std::string const& path, CompareLeft cmpL = CompareLeft(), CompareRight cmpR = CompareRight())
+        : view(std::move(cmpL), std::move(cmpR)), path(path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot open " + path);
+        }
+        struct stat st{};
+        if (::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(frozen_header)) {
+            ::close(fd);
+            throw std::runtime_error(path + " is not a frozen bimap of these key types");
+        }
+        length = static_cast<std::size_t>(st.st_size);
+        void* data = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "Cannot map " + path);
+        }
+        mapping = static_cast<char const*>(data);
+        try {
+            std::size_t n = view::check(*reinterpret_cast<frozen_header const*>(mapping), length, path);
+            frozen_layout layout(n, sizeof(Left), sizeof(Right));
+            this->point(reinterpret_cast<Left const*>(mapping + layout.offsets[0]),
+                        reinterpret_cast<Right const*>(mapping + layout.offsets[1]),
+                        reinterpret_cast<std::uint32_t const*>(mapping + layout.offsets[2]),
+                        reinterpret_cast<std::uint32_t const*>(mapping + layout.offsets[3]), n);
+        } catch (...) {
+            ::munmap(const_cast<char*>(mapping), length);
+            throw;
+        }
+    }
+
+    // Leaves other empty.
+    mapped_bimap(mapped_bimap&& other) noexcept
+        : view(other.l_comp, other.r_comp), path(std::move(other.path)), mapping(other.mapping), length(other.length) {
+        this->swap_arrays(other);
+        other.mapping = nullptr;
+        other.length = 0;
+    }
+
+    mapped_bimap& operator=(mapped_bimap&& other) noexcept {
+        std::swap(this->l_comp, other.l_comp);
+        std::swap(this->r_comp, other.r_comp);
+        path.swap(other.path);
+        std::swap(mapping, other.mapping);
+        std::swap(length, other.length);
+        this->swap_arrays(other);
+        return *this;
+    }
+
+    ~mapped_bimap() {
+        if (mapping) {
+            ::munmap(const_cast<char*>(mapping), length);
+        }
+    }
+
+    // Checks that the cross indices are inverse permutations of the slots,
+    // so flip() stays in bounds, and throws std::runtime_error otherwise.
+    // Takes O(n) and reads the cross indices of the whole file.
+    void validate() const {
+        this->check_cross(path);
+    }
+
+private:
+    using view = frozen_view<Left, Right, CompareLeft, CompareRight>;
+
+    std::string path;
+    char const* mapping = nullptr;
+    std::size_t length = 0;
 };
+#endif
@@ -1,7 +1,15 @@
 #include "bimap.h"
 
 #include "gtest/gtest.h"
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <map>
 #include <random>
+#include <set>
+#include <sstream>
+#include <string_view>
+#include <thread>
 
 struct test_object {
     int a = 0;
@@ -103,6 +111,94 @@ TEST(bimap, copies) {
     EXPECT_NE(b.find_right(-10), b.end_right());
 }
 
+TEST(bimap, range_constructor) {
+    std::vector<std::pair<int, int>> data = {
+        {5, 50}, {1, 10}, {3, 30}, {1, 11}, {4, 10}, {2, 20}};
+    bimap<int, int> b(data.begin(), data.end());
+    // (1, 11) repeats left key 1, (4, 10) repeats right key 10.
+    EXPECT_EQ(b.size(), 4);
+    std::vector<std::pair<int, int>> expected = {
+        {1, 10}, {2, 20}, {3, 30}, {5, 50}};
+    auto it = b.begin_left();
+    for (auto const &p : expected) {
+        EXPECT_EQ(*it, p.first);
+        EXPECT_EQ(*it.flip(), p.second);
+        it++;
+    }
+    EXPECT_EQ(it, b.end_left());
+    EXPECT_EQ(*b.begin_right(), 10);
+    EXPECT_EQ(*--b.end_right(), 50);
+
+    b.insert(0, 0);
+    EXPECT_TRUE(b.erase_left(3));
+    EXPECT_EQ(b.size(), 4);
+    EXPECT_EQ(*b.begin_left(), 0);
+}
+
+TEST(bimap, assign_sorted) {
+    std::vector<std::pair<int, int>> data;
+    for (int i = 0; i < 1000; i++) {
+        data.emplace_back(i, (i * 7) % 1000);
+    }
+    bimap<int, int> b;
+    b.insert(-1, -1);
+    b.assign(data.begin(), data.end(), true);
+    EXPECT_EQ(b.size(), 1000);
+    EXPECT_EQ(b.find_left(-1), b.end_left());
+    for (int i = 0; i < 1000; i++) {
+        EXPECT_EQ(b.at_left(i), (i * 7) % 1000);
+    }
+    int expected = 0;
+    for (auto it = b.begin_right(); it != b.end_right(); it++) {
+        EXPECT_EQ(*it, expected++);
+    }
+    EXPECT_EQ(b, (bimap<int, int>(data.rbegin(), data.rend())));
+
+    std::vector<std::pair<std::string, test_object>> movable;
+    movable.emplace_back("a", test_object(1));
+    movable.emplace_back("b", test_object(2));
+    bimap<std::string, test_object> b1;
+    b1.assign(std::make_move_iterator(movable.begin()),
+              std::make_move_iterator(movable.end()), true);
+    EXPECT_EQ(b1.at_left("b"), test_object(2));
+    EXPECT_EQ(movable[0].second.a, 0);
+}
+
+struct counting_less {
+    bool operator()(int a, int b) const {
+        calls++;
+        return a < b;
+    }
+
+    static inline int calls = 0;
+};
+
+TEST(bimap, copy_clones_structure) {
+    bimap<int, int, counting_less, counting_less> b;
+    std::mt19937 e(1488228);
+    for (int i = 0; i < 2000; i++) {
+        b.insert(e() % 5000, e() % 5000);
+    }
+    b.erase_left(b.lower_bound_left(4000), b.end_left());
+
+    counting_less::calls = 0;
+    auto copy = b;
+    EXPECT_EQ(counting_less::calls, 0);
+    EXPECT_EQ(copy, b);
+
+    copy.insert(10000, 10000);
+    EXPECT_TRUE(copy.erase_left(*b.begin_left()));
+    EXPECT_EQ(copy.size(), b.size());
+    EXPECT_NE(copy, b);
+    EXPECT_EQ(b.find_left(10000), b.end_left());
+    EXPECT_EQ(*--copy.end_right(), 10000);
+    int previous = *copy.begin_right();
+    for (auto it = ++copy.begin_right(); it != copy.end_right(); it++) {
+        EXPECT_LT(previous, *it);
+        previous = *it;
+    }
+}
+
 TEST(bimap, insert) {
     bimap<int, int> b;
     b.insert(4, 10);
@@ -158,6 +254,51 @@ TEST(bimap, at_or_default) {
     EXPECT_EQ(b.at_left(0), 1000);
 }
 
+struct id_compare {
+    using is_transparent = void;
+
+    bool operator()(std::string const &a, std::string const &b) const {
+        return a < b;
+    }
+    bool operator()(std::string const &a, std::string_view b) const {
+        lookups++;
+        return a < b;
+    }
+    bool operator()(std::string_view a, std::string const &b) const {
+        lookups++;
+        return a < b;
+    }
+
+    static inline int lookups = 0;
+};
+
+TEST(bimap, heterogeneous_lookup) {
+    bimap<std::string, int, id_compare> b;
+    b.insert("apple", 1);
+    b.insert("banana", 2);
+    b.insert("cherry", 3);
+
+    id_compare::lookups = 0;
+    std::string_view key = "banana";
+    EXPECT_EQ(b.at_left(key), 2);
+    EXPECT_EQ(*b.find_left(key).flip(), 2);
+    EXPECT_EQ(*b.lower_bound_left(std::string_view("b")), "banana");
+    EXPECT_EQ(*b.upper_bound_left(key), "cherry");
+    EXPECT_EQ(b.find_left(std::string_view("durian")), b.end_left());
+    EXPECT_GT(id_compare::lookups, 0);
+
+    EXPECT_TRUE(b.erase_left(key));
+    EXPECT_FALSE(b.erase_left(key));
+    EXPECT_EQ(b.size(), 2);
+
+    bimap<int, std::string, std::less<>, std::less<>> b1;
+    b1.insert(1, "one");
+    EXPECT_EQ(b1.at_right("one"), 1);
+    EXPECT_EQ(*b1.lower_bound_right(std::string_view("o")), "one");
+    EXPECT_TRUE(b1.erase_right("one"));
+    EXPECT_TRUE(b1.empty());
+}
+
 TEST(bimap, find) {
     bimap<int, int> b;
     b.insert(3, 4);
@@ -188,6 +329,215 @@ TEST(bimap, insert_exist) {
     EXPECT_EQ(b.size(), 3);
 }
 
+TEST(bimap, try_insert) {
+    bimap<int, int> b;
+    auto res = b.try_insert(1, 2);
+    EXPECT_TRUE(res.second);
+    EXPECT_EQ(*res.first, 1);
+    b.try_insert(2, 3);
+
+    res = b.try_insert(2, 100);
+    EXPECT_FALSE(res.second);
+    EXPECT_EQ(*res.first.flip(), 3);
+
+    res = b.try_insert(100, 2);
+    EXPECT_FALSE(res.second);
+    EXPECT_EQ(*res.first, 1);
+    EXPECT_EQ(b.size(), 2);
+}
+
+TEST(bimap, insert_batch) {
+    bimap<int, int> b;
+    b.insert(1, 10);
+    b.insert(5, 50);
+    std::vector<std::pair<int, int>> batch = {{2, 20}, {1, 11}, {3, 50}, {4, 20},
+                                              {2, 21}, {3, 30}, {0, 0}, {6, 60}};
+    std::vector<bool> expected = {true, false, false, false, false, true, true, true};
+    EXPECT_EQ(b.insert_batch(batch.begin(), batch.end()), expected);
+    EXPECT_EQ(b.size(), 6);
+    EXPECT_EQ(*b.begin_left(), 0);
+    EXPECT_EQ(*b.begin_right(), 0);
+    EXPECT_EQ(b.at_left(2), 20);
+    EXPECT_EQ(b.at_left(3), 30);
+    EXPECT_EQ(b.at_right(60), 6);
+    EXPECT_TRUE(b.insert_batch(batch.end(), batch.end()).empty());
+}
+
+TEST(bimap, merge) {
+    bimap<int, int> a, b;
+    a.insert(1, 10);
+    a.insert(3, 30);
+    b.insert(0, 0);
+    b.insert(1, 11);
+    b.insert(2, 30);
+    b.insert(4, 40);
+    a.merge(std::move(b));
+    EXPECT_EQ(a.size(), 4);
+    EXPECT_EQ(a.at_left(0), 0);
+    EXPECT_EQ(a.at_left(1), 10);
+    EXPECT_EQ(a.at_left(4), 40);
+    EXPECT_EQ(*a.begin_left(), 0);
+    EXPECT_EQ(b.size(), 2);
+    EXPECT_EQ(b.at_left(1), 11);
+    EXPECT_EQ(b.at_left(2), 30);
+    EXPECT_EQ(*b.begin_right(), 11);
+    a.merge(std::move(a));
+    EXPECT_EQ(a.size(), 4);
+}
+
+TEST(bimap, intersect_and_difference) {
+    bimap<int, int> a, b;
+    for (int i = 0; i < 10; i++) {
+        a.insert(i, i);
+        b.insert(i * 2, i % 2 ? i * 2 : -i);
+    }
+    bimap<int, int> c = a;
+    c.intersect(b);
+    EXPECT_EQ(c.size(), 3);
+    EXPECT_EQ(c.at_left(2), 2);
+    EXPECT_EQ(c.at_left(6), 6);
+    EXPECT_EQ(c.find_left(4), c.end_left());
+    a.difference(b);
+    EXPECT_EQ(a.size(), 7);
+    EXPECT_EQ(a.find_left(2), a.end_left());
+    EXPECT_EQ(a.at_left(4), 4);
+    c.difference(c);
+    EXPECT_TRUE(c.empty());
+}
+
+TEST(bimap, diff) {
+    bimap<int, int> a, b;
+    a.insert(1, 10);
+    a.insert(2, 20);
+    a.insert(3, 30);
+    b.insert(2, 20);
+    b.insert(3, 31);
+    b.insert(4, 40);
+    auto d = diff(a, b);
+    ASSERT_EQ(d.added.size(), 1);
+    EXPECT_EQ(*d.added[0], 4);
+    ASSERT_EQ(d.removed.size(), 1);
+    EXPECT_EQ(*d.removed[0], 1);
+    ASSERT_EQ(d.changed.size(), 1);
+    EXPECT_EQ(*d.changed[0].first.flip(), 30);
+    EXPECT_EQ(*d.changed[0].second.flip(), 31);
+    EXPECT_TRUE(diff(a, a).changed.empty());
+}
+
+TEST(bimap, split_heterogeneous) {
+    bimap<std::string, int, std::less<>> b;
+    for (int i = 0; i < 26; i++) {
+        b.insert(std::string(1, static_cast<char>('a' + i)), i);
+    }
+    auto upper = b.split_left(std::string_view("m"));
+    EXPECT_EQ(b.size(), 12);
+    EXPECT_EQ(*upper.begin_left(), "m");
+    auto top = upper.split_left("x");
+    EXPECT_EQ(top.size(), 3);
+}
+
+TEST(bimap, split_and_join) {
+    bimap<int, int> b;
+    for (int i = 0; i < 100; i++) {
+        b.insert(i, (i * 37) % 100);
+    }
+    bimap<int, int> upper = b.split_left(30);
+    EXPECT_EQ(b.size(), 30);
+    EXPECT_EQ(upper.size(), 70);
+    EXPECT_EQ(*b.begin_left(), 0);
+    EXPECT_EQ(*upper.begin_left(), 30);
+    EXPECT_EQ(upper.at_left(99), 63);
+    EXPECT_EQ(upper.find_left(29), upper.end_left());
+    EXPECT_EQ(b.find_right(63), b.end_right());
+    b.join(std::move(upper));
+    EXPECT_TRUE(upper.empty());
+    EXPECT_EQ(b.size(), 100);
+    bimap<int, int> all = b.split_left(-1);
+    EXPECT_TRUE(b.empty());
+    EXPECT_EQ(all.size(), 100);
+    bimap<int, int> none = all.split_right(100);
+    EXPECT_TRUE(none.empty());
+    bimap<int, int> right_upper = all.split_right(90);
+    EXPECT_EQ(right_upper.size(), 10);
+    EXPECT_EQ(*right_upper.begin_right(), 90);
+    EXPECT_EQ(*all.begin_left(), 0);
+}
+
+TEST(bimap, join_checks_preconditions) {
+    bimap<int, int> a, b;
+    for (int i = 0; i < 10; i++) {
+        a.insert(i, i);
+        b.insert(i + 10, i + 5);
+    }
+    EXPECT_THROW(a.join(std::move(b)), std::invalid_argument);
+    EXPECT_EQ(a.size(), 10);
+    EXPECT_EQ(b.size(), 10);
+    bimap<int, int> c;
+    c.insert(5, 100);
+    EXPECT_THROW(a.join(std::move(c)), std::invalid_argument);
+    EXPECT_EQ(c.size(), 1);
+    b.erase_right(5);
+    EXPECT_THROW(b.join(std::move(a)), std::invalid_argument);
+    for (int i = 5; i < 10; i++) {
+        b.erase_right(i);
+    }
+    a.join(std::move(b));
+    EXPECT_EQ(a.size(), 15);
+    EXPECT_TRUE(b.empty());
+}
+
+TEST(bimap, join_and_merge_across_allocators) {
+    using pooled = bimap<int, int, std::less<>, std::less<>, node_pool_allocator<int>>;
+    pooled a, b, c;
+    for (int i = 0; i < 100; i++) {
+        a.insert(i, -i);
+        b.insert(i + 100, -i - 100);
+        c.insert(i * 2, i);
+    }
+    a.join(std::move(b));
+    EXPECT_TRUE(b.empty());
+    EXPECT_EQ(a.size(), 200);
+    EXPECT_EQ(a.at_left(150), -150);
+    a.merge(std::move(c));
+    EXPECT_EQ(a.size(), 200);
+    EXPECT_EQ(c.size(), 100);
+    b.insert(1, 1000);
+    b.insert(500, 500);
+    a.merge(std::move(b));
+    EXPECT_EQ(a.at_left(500), 500);
+    EXPECT_EQ(b.size(), 1);
+    EXPECT_EQ(b.at_left(1), 1000);
+}
+
+TEST(bimap, emplace) {
+    bimap<std::string, std::pair<int, int>> b;
+    auto res = b.emplace(std::piecewise_construct, std::forward_as_tuple(3, 'a'),
+                         std::forward_as_tuple(1, 2));
+    EXPECT_TRUE(res.second);
+    EXPECT_EQ(*res.first, "aaa");
+    EXPECT_EQ(b.at_left("aaa"), std::make_pair(1, 2));
+
+    res = b.emplace("bb", std::make_pair(3, 4));
+    EXPECT_TRUE(res.second);
+    EXPECT_EQ(b.at_right({3, 4}), "bb");
+
+    res = b.emplace("aaa", std::make_pair(5, 6));
+    EXPECT_FALSE(res.second);
+    EXPECT_EQ(*res.first, "aaa");
+    EXPECT_EQ(b.size(), 2);
+}
+
+TEST(bimap, emplace_move_only) {
+    bimap<int, test_object> b;
+    test_object x(3);
+    b.emplace(1, std::move(x));
+    EXPECT_EQ(x.a, 0);
+    EXPECT_EQ(b.at_left(1), test_object(3));
+    b.emplace(std::piecewise_construct, std::forward_as_tuple(2),
+              std::forward_as_tuple(4));
+    EXPECT_EQ(b.at_right(test_object(4)), 2);
+}
+
 TEST(bimap, erase_iterator) {
     bimap<int, int> b;
     auto it = b.insert(1, 2);
@@ -238,6 +588,22 @@ TEST(bimap, erase_range) {
     EXPECT_TRUE(b.empty());
 }
 
+TEST(bimap, erase_range_to_end) {
+    for (int shift = 0; shift < 50; shift++) {
+        bimap<int, int> b;
+        for (int i = 0; i < 100; i++) {
+            b.insert(i, (i + shift) % 100);
+        }
+        b.erase_left(b.end_left(), b.end_left());
+        b.erase_left(b.find_left(shift), b.end_left());
+        EXPECT_EQ(b.size(), shift);
+        b.erase_right(b.lower_bound_right(50), b.end_right());
+        for (auto it = b.begin_right(); it != b.end_right(); it++) {
+            EXPECT_LT(*it, 50);
+        }
+    }
+}
+
 TEST(bimap, lower_bound) {
     bimap<int, int> b;
 
@@ -273,6 +639,1102 @@ TEST(bimap, upper_bound) {
     EXPECT_EQ(b.upper_bound_left(400), b.end_left());
 }
 
+TEST(bimap, move_keeps_comparator) {
+    bimap<int, int, std::function<bool(int, int)>> b(std::greater<>{});
+    b.insert(1, 1);
+    b.insert(2, 2);
+    bimap<int, int, std::function<bool(int, int)>> b1(std::move(b));
+    b1.insert(3, 3);
+    EXPECT_EQ(*b1.begin_left(), 3);
+    EXPECT_EQ(b1.size(), 3);
+    EXPECT_EQ(*--b1.end_left(), 1);
+}
+
+static int64_t allocated_nodes = 0;
+static int64_t allocation_limit = std::numeric_limits<int64_t>::max();
+
+template <typename T>
+struct counting_allocator {
+    using value_type = T;
+
+    counting_allocator() = default;
+    template <typename U>
+    counting_allocator(counting_allocator<U> const &) noexcept {}
+
+    T *allocate(size_t n) {
+        if (allocated_nodes + static_cast<int64_t>(n) > allocation_limit) {
+            throw std::bad_alloc();
+        }
+        allocated_nodes += n;
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *ptr, size_t n) noexcept {
+        allocated_nodes -= n;
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    template <typename U>
+    friend bool operator==(counting_allocator const &,
+                           counting_allocator<U> const &) {
+        return true;
+    }
+    template <typename U>
+    friend bool operator!=(counting_allocator const &,
+                           counting_allocator<U> const &) {
+        return false;
+    }
+};
+
+TEST(bimap, custom_allocator) {
+    using counted =
+        bimap<int, int, std::less<>, std::less<>, counting_allocator<int>>;
+    {
+        counted b;
+        for (int i = 0; i < 100; i++) {
+            b.insert(i, -i);
+        }
+        EXPECT_EQ(allocated_nodes, 101);
+        b.erase_left(b.find_left(10), b.find_left(20));
+        EXPECT_EQ(allocated_nodes, 91);
+        counted b1(b);
+        EXPECT_EQ(allocated_nodes, 182);
+        EXPECT_EQ(b, b1);
+    }
+    EXPECT_EQ(allocated_nodes, 0);
+}
+
+TEST(bimap, emplace_duplicate_does_not_allocate) {
+    using counted = bimap<std::string, std::string, std::less<>, std::less<>,
+                          counting_allocator<int>>;
+    counted b;
+    b.emplace("a", "b");
+    int64_t before = allocated_nodes;
+    EXPECT_FALSE(b.emplace("a", "c").second);
+    EXPECT_FALSE(b.emplace(std::piecewise_construct, std::forward_as_tuple("c"),
+                           std::forward_as_tuple(1, 'b'))
+                     .second);
+    EXPECT_EQ(allocated_nodes, before);
+}
+
+static int comparisons_left = std::numeric_limits<int>::max();
+
+struct throwing_less {
+    bool operator()(int a, int b) const {
+        if (comparisons_left-- <= 0) {
+            throw std::runtime_error("comparison budget exhausted");
+        }
+        return a < b;
+    }
+};
+
+TEST(bimap, assign_with_throwing_comparator) {
+    using counted = bimap<int, int, throwing_less, throwing_less, counting_allocator<int>>;
+    std::vector<std::pair<int, int>> pairs;
+    for (int i = 0; i < 1000; i++) {
+        pairs.emplace_back(i * 7 % 1000, i % 500);
+    }
+    counted b;
+    b.insert(1, 1);
+    int64_t before = allocated_nodes;
+    for (int budget : {0, 100, 5000, 12000}) {
+        comparisons_left = budget;
+        EXPECT_THROW((counted(pairs.begin(), pairs.end())), std::runtime_error);
+        comparisons_left = budget;
+        EXPECT_THROW(b.assign(pairs.begin(), pairs.end()), std::runtime_error);
+        comparisons_left = std::numeric_limits<int>::max();
+        EXPECT_EQ(allocated_nodes, before);
+        EXPECT_EQ(b.size(), 1);
+        EXPECT_EQ(b.at_left(1), 1);
+    }
+    b.assign(pairs.begin(), pairs.end());
+    EXPECT_EQ(b.size(), 500);
+}
+
+TEST(bimap, split_with_throwing_comparator) {
+    using counted = bimap<int, int, throwing_less, throwing_less, counting_allocator<int>>;
+    counted b;
+    for (int i = 0; i < 1000; i++) {
+        b.insert(i, (i * 7) % 1000);
+    }
+    counted copy(b);
+    int64_t before = allocated_nodes;
+    for (int budget : {0, 5, 100, 1000}) {
+        for (int key : {300, 700}) {
+            comparisons_left = budget;
+            EXPECT_THROW(b.split_left(key), std::runtime_error);
+            comparisons_left = budget;
+            EXPECT_THROW(b.split_right(key), std::runtime_error);
+            comparisons_left = std::numeric_limits<int>::max();
+            EXPECT_EQ(allocated_nodes, before);
+            EXPECT_EQ(b, copy);
+        }
+    }
+    counted upper = b.split_right(700);
+    EXPECT_EQ(upper.size(), 300);
+    b.merge(std::move(upper));
+    EXPECT_EQ(b, copy);
+}
+
+TEST(bimap, insert_batch_allocates_only_inserted) {
+    using counted = bimap<int, int, std::less<>, std::less<>, counting_allocator<int>>;
+    for (int base : {10, 100000}) {
+        counted b;
+        std::vector<std::pair<int, int>> existing;
+        for (int i = 0; i < base; i++) {
+            existing.emplace_back(2 * i, 2 * i);
+        }
+        b.insert_batch(existing.begin(), existing.end());
+        std::vector<std::pair<int, int>> batch;
+        for (int i = 0; i < 1000; i++) {
+            batch.emplace_back(i, i % 3 == 0 ? 2 * i : -i);
+        }
+        int64_t before = allocated_nodes;
+        std::vector<bool> inserted = b.insert_batch(batch.begin(), batch.end());
+        EXPECT_EQ(allocated_nodes - before, std::count(inserted.begin(), inserted.end(), true));
+
+        counted copy(b);
+        for (auto &kv : batch) {
+            kv = {kv.first + 1000000, kv.first + 1000000};
+        }
+        before = allocated_nodes;
+        allocation_limit = before + 10;
+        EXPECT_THROW(b.insert_batch(batch.begin(), batch.end()), std::bad_alloc);
+        allocation_limit = std::numeric_limits<int64_t>::max();
+        EXPECT_EQ(allocated_nodes, before);
+        EXPECT_EQ(b, copy);
+        b.insert_batch(batch.begin(), batch.end());
+        EXPECT_EQ(b.at_left(1000001), 1000001);
+    }
+    EXPECT_EQ(allocated_nodes, 0);
+}
+
+TEST(bimap, pool_allocator) {
+    using pooled = bimap<std::string, int, std::less<>, std::less<>,
+                         node_pool_allocator<std::string>>;
+    pooled b;
+    std::map<std::string, int> expected;
+    std::mt19937 e(1488228);
+    for (int i = 0; i < 5000; i++) {
+        auto key = std::to_string(e() % 2000);
+        if (e() % 3 == 0) {
+            EXPECT_EQ(b.erase_left(key), expected.erase(key) == 1);
+        } else if (expected.count(key) == 0) {
+            b.insert(key, i);
+            expected.emplace(key, i);
+        }
+    }
+    pooled copy(b);
+    pooled moved(std::move(b));
+    EXPECT_EQ(copy, moved);
+    EXPECT_EQ(moved.size(), expected.size());
+    auto it = moved.begin_left();
+    for (auto const &kv : expected) {
+        EXPECT_EQ(*it, kv.first);
+        EXPECT_EQ(*it.flip(), kv.second);
+        it++;
+    }
+
+    bimap<int, int, std::less<>, std::less<>, node_pool_allocator<int>> ints;
+    for (int i = 0; i < 10000; i++) {
+        ints.insert(i, i * 7 % 10007);
+    }
+    EXPECT_EQ(ints.at_right(7), 1);
+}
+
+TEST(bimap, shared_pool_allocator) {
+    using pooled = bimap<int, int, std::less<>, std::less<>, node_pool_allocator<int>>;
+    node_pool_allocator<int> alloc;
+    std::set<int const *> first_nodes;
+    {
+        pooled b(std::less<>(), std::less<>(), alloc);
+        for (int i = 0; i < 10000; i++) {
+            b.insert(i, -i);
+        }
+        for (auto it = b.begin_left(); it != b.end_left(); it++) {
+            first_nodes.insert(&*it);
+        }
+    }
+    for (int round = 0; round < 5; round++) {
+        pooled b(std::less<>(), std::less<>(), alloc);
+        for (int i = 0; i < 10000; i++) {
+            b.insert(i * 3, i);
+        }
+        for (auto it = b.begin_left(); it != b.end_left(); it++) {
+            EXPECT_EQ(first_nodes.count(&*it), 1u);
+        }
+        EXPECT_EQ(b.at_left(300), 100);
+    }
+}
+
+using counted_bimap = bimap<int, int, std::less<int>, std::less<int>,
+                           std::allocator<std::pair<int, int>>, true>;
+
+TEST(bimap, order_statistics) {
+    counted_bimap b;
+    for (int i = 0; i < 100; i++) {
+        b.insert(i * 2, 1000 - i);
+    }
+    EXPECT_EQ(*b.nth_left(0), 0);
+    EXPECT_EQ(*b.nth_left(10), 20);
+    EXPECT_EQ(b.nth_left(100), b.end_left());
+    EXPECT_EQ(b.nth_left(1000), b.end_left());
+    EXPECT_EQ(*b.nth_right(0), 901);
+    EXPECT_EQ(*b.nth_right(0).flip(), 198);
+
+    EXPECT_EQ(b.rank_left(-5), 0);
+    EXPECT_EQ(b.rank_left(20), 10);
+    EXPECT_EQ(b.rank_left(21), 11);
+    EXPECT_EQ(b.rank_left(1000), 100);
+    EXPECT_EQ(b.rank_right(1000), 99);
+    EXPECT_EQ(b.count_range_left(10, 20), 5);
+    EXPECT_EQ(b.count_range_left(20, 10), 0);
+    EXPECT_EQ(b.count_range_right(950, 2000), 51);
+}
+
+TEST(bimap_randomized, order_statistics) {
+    counted_bimap b;
+    std::map<int, int> left_view, right_view;
+    std::mt19937 e(1488228);
+    auto check = [&](counted_bimap const &m) {
+        ASSERT_EQ(m.size(), left_view.size());
+        size_t i = 0;
+        for (auto const &p : left_view) {
+            ASSERT_EQ(*m.nth_left(i), p.first);
+            ASSERT_EQ(m.rank_left(p.first), i);
+            i++;
+        }
+        i = 0;
+        for (auto const &p : right_view) {
+            ASSERT_EQ(*m.nth_right(i), p.first);
+            ASSERT_EQ(m.rank_right(p.first), i);
+            i++;
+        }
+    };
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < 100; i++) {
+            int l = e() % 1000, r = e() % 1000;
+            if (b.insert(l, r) != b.end_left()) {
+                left_view[l] = r;
+                right_view[r] = l;
+            }
+        }
+        for (int i = 0; i < 30 && !b.empty(); i++) {
+            auto it = b.nth_left(e() % b.size());
+            right_view.erase(*it.flip());
+            left_view.erase(*it);
+            b.erase_left(it);
+        }
+        int lo = e() % 1000, hi = lo + e() % 50;
+        b.erase_left(b.lower_bound_left(lo), b.lower_bound_left(hi));
+        left_view.erase(left_view.lower_bound(lo), left_view.lower_bound(hi));
+        right_view.clear();
+        for (auto const &p : left_view) {
+            right_view[p.second] = p.first;
+        }
+        check(b);
+        lo = e() % 1000, hi = lo + e() % 400;
+        b.erase_right(b.lower_bound_right(lo), b.lower_bound_right(hi));
+        right_view.erase(right_view.lower_bound(lo), right_view.lower_bound(hi));
+        left_view.clear();
+        for (auto const &p : right_view) {
+            left_view[p.second] = p.first;
+        }
+        check(b);
+        check(counted_bimap(b));
+    }
+    std::vector<std::pair<int, int>> data(left_view.begin(), left_view.end());
+    b.assign(data.begin(), data.end(), true);
+    check(b);
+}
+
+TEST(bimap, build_on_several_threads) {
+    std::vector<bimap<int, int>> maps(4);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < maps.size(); t++) {
+        threads.emplace_back([&maps, t] {
+            for (int i = 0; i < 1000; i++) {
+                maps[t].insert(i, (i * 7 + static_cast<int>(t)) % 1000);
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    for (auto const &m : maps) {
+        EXPECT_EQ(m.size(), 1000);
+        int expected = 0;
+        for (auto it = m.begin_right(); it != m.end_right(); it++) {
+            EXPECT_EQ(*it, expected++);
+        }
+    }
+}
+
+TEST(concurrent_bimap, basic) {
+    concurrent_bimap<int, std::string> b;
+    EXPECT_TRUE(b.insert(1, "a"));
+    EXPECT_FALSE(b.insert(1, "b"));
+    EXPECT_TRUE(b.insert(2, "b"));
+    EXPECT_EQ(b.find_left(1), "a");
+    EXPECT_EQ(b.find_right("b"), 2);
+    EXPECT_EQ(b.find_left(3), std::nullopt);
+    EXPECT_EQ(b.at_right("a"), 1);
+    EXPECT_THROW(b.at_left(3), std::out_of_range);
+    EXPECT_TRUE(b.erase_left(1));
+    EXPECT_FALSE(b.erase_right("a"));
+    EXPECT_EQ(b.size(), 1);
+    b.write([](auto &m) { m.insert(5, "e"); });
+    EXPECT_EQ(b.read([](auto const &m) { return *m.begin_left(); }), 2);
+    EXPECT_EQ(b.size(), 2);
+}
+
+TEST(concurrent_bimap, throwing_write_keeps_copies_equal) {
+    concurrent_bimap<int, int> b;
+    b.insert(1, 1);
+    auto both_copies = [&] {
+        std::vector<int> first = b.read([](auto const &m) {
+            return std::vector<int>(m.begin_left(), m.end_left());
+        });
+        b.write([](auto &) {});
+        std::vector<int> second = b.read([](auto const &m) {
+            return std::vector<int>(m.begin_left(), m.end_left());
+        });
+        EXPECT_EQ(first, second);
+        return first;
+    };
+    int calls = 0;
+    EXPECT_THROW(b.write([&](auto &m) {
+        m.insert(2, 2);
+        if (++calls == 2) {
+            throw std::runtime_error("second copy");
+        }
+    }), std::runtime_error);
+    EXPECT_EQ(both_copies(), std::vector<int>({1, 2}));
+    EXPECT_THROW(b.write([](auto &m) {
+        m.insert(3, 3);
+        throw std::runtime_error("first copy");
+    }), std::runtime_error);
+    EXPECT_EQ(both_copies(), std::vector<int>({1, 2}));
+}
+
+TEST(concurrent_bimap, readers_see_consistent_pairs) {
+    concurrent_bimap<int, int> b;
+    std::atomic<bool> done{false};
+    std::atomic<size_t> lookups{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; t++) {
+        readers.emplace_back([&, t] {
+            std::mt19937 e(t);
+            size_t local = 0;
+            do {
+                int key = e() % 1000;
+                auto right = b.find_left(key);
+                if (right) {
+                    EXPECT_EQ(*right, -key);
+                    EXPECT_EQ(b.find_right(-key).value_or(key), key);
+                }
+                local++;
+            } while (!done.load());
+            lookups += local;
+        });
+    }
+    std::mt19937 e(1488228);
+    for (int i = 0; i < 2000; i++) {
+        int key = e() % 1000;
+        if (e() % 2) {
+            b.insert(key, -key);
+        } else {
+            b.erase_left(key);
+        }
+    }
+    done = true;
+    for (auto &t : readers) {
+        t.join();
+    }
+    EXPECT_GT(lookups.load(), 0);
+}
+
+TEST(persistent_bimap, versions) {
+    persistent_bimap<int, std::string> v0;
+    auto v1 = v0.insert(1, "a");
+    auto v2 = v1.insert(2, "b");
+    auto v3 = v2.insert(3, "b");
+    auto v4 = v2.erase_left(1);
+    EXPECT_TRUE(v0.empty());
+    EXPECT_EQ(v1.size(), 1);
+    EXPECT_EQ(v2.size(), 2);
+    EXPECT_EQ(v3.size(), 2);
+    EXPECT_EQ(v4.size(), 1);
+    EXPECT_EQ(v2.at_left(1), "a");
+    EXPECT_EQ(v4.find_left(1), nullptr);
+    EXPECT_EQ(v4.at_right("b"), 2);
+    EXPECT_EQ(v2.erase_right("c").size(), 2);
+    EXPECT_THROW(v1.at_right("b"), std::out_of_range);
+    std::vector<int> lefts;
+    v2.for_each([&](int l, std::string const &) { lefts.push_back(l); });
+    EXPECT_EQ(lefts, (std::vector<int>{1, 2}));
+    v1 = v4;
+    EXPECT_EQ(v1.at_left(2), "b");
+}
+
+TEST(persistent_bimap, randomized_snapshots) {
+    std::mt19937 e(1488228);
+    std::vector<persistent_bimap<int, int>> versions(1);
+    std::vector<std::map<int, int>> expected(1);
+    for (int i = 0; i < 2000; i++) {
+        size_t from = e() % versions.size();
+        int l = e() % 200, r = e() % 200;
+        std::map<int, int> next = expected[from];
+        persistent_bimap<int, int> version;
+        if (e() % 3) {
+            version = versions[from].insert(l, r);
+            bool free = next.count(l) == 0 &&
+                        std::none_of(next.begin(), next.end(), [r](auto const &p) { return p.second == r; });
+            if (free) {
+                next[l] = r;
+            }
+        } else {
+            version = versions[from].erase_left(l);
+            next.erase(l);
+        }
+        versions.push_back(version);
+        expected.push_back(next);
+        if (versions.size() > 50) {
+            versions.erase(versions.begin());
+            expected.erase(expected.begin());
+        }
+    }
+    for (size_t i = 0; i < versions.size(); i++) {
+        ASSERT_EQ(versions[i].size(), expected[i].size());
+        auto it = expected[i].begin();
+        versions[i].for_each([&](int l, int r) {
+            ASSERT_EQ(l, it->first);
+            ASSERT_EQ(r, it->second);
+            ASSERT_EQ(*versions[i].find_right(r), l);
+            ++it;
+        });
+    }
+}
+
+struct tracked_key {
+    static inline int live = 0;
+    int value;
+
+    tracked_key(int value) : value(value) { live++; }
+    tracked_key(tracked_key const &other) : value(other.value) { live++; }
+    ~tracked_key() { live--; }
+};
+
+struct throwing_tracked_less {
+    bool operator()(tracked_key const &a, tracked_key const &b) const {
+        return throwing_less()(a.value, b.value);
+    }
+};
+
+TEST(persistent_bimap, throwing_comparator) {
+    using map_t = persistent_bimap<tracked_key, tracked_key, throwing_tracked_less, throwing_tracked_less>;
+    {
+        map_t b;
+        for (int i = 0; i < 200; i++) {
+            b = b.insert(i, 1000 - i);
+        }
+        int failures = 0;
+        for (int budget = 0; budget < 80; budget++) {
+            comparisons_left = budget;
+            try {
+                map_t inserted = b.insert(500 + budget, 5000 + budget);
+                EXPECT_EQ(inserted.size(), 201);
+            } catch (std::runtime_error const &) {
+                failures++;
+            }
+            comparisons_left = budget;
+            try {
+                map_t erased = b.erase_left(budget * 2);
+                EXPECT_EQ(erased.size(), 199);
+            } catch (std::runtime_error const &) {
+                failures++;
+            }
+            comparisons_left = std::numeric_limits<int>::max();
+        }
+        EXPECT_GT(failures, 0);
+        EXPECT_EQ(b.size(), 200);
+        for (int i = 0; i < 200; i++) {
+            EXPECT_EQ(b.at_left(i).value, 1000 - i);
+        }
+    }
+    EXPECT_EQ(tracked_key::live, 0);
+}
+
+TEST(unordered_bimap, basic) {
+    unordered_bimap<int, std::string> b;
+    b.insert(1, "a");
+    auto it = b.insert(2, "b");
+    EXPECT_EQ(*it.flip(), "b");
+    it = b.insert(1, "c");
+    EXPECT_EQ(it, b.end_left());
+    it = b.insert(3, "b");
+    EXPECT_EQ(it, b.end_left());
+    EXPECT_EQ(b.size(), 2);
+    EXPECT_EQ(b.at_left(1), "a");
+    EXPECT_EQ(b.at_right("b"), 2);
+    EXPECT_EQ(*b.find_right("a").flip(), 1);
+    EXPECT_THROW(b.at_left(3), std::out_of_range);
+    EXPECT_EQ(b.at_left_or_default(3), "");
+    EXPECT_EQ(b.at_right_or_default("c"), 0);
+    EXPECT_TRUE(b.erase_left(1));
+    EXPECT_FALSE(b.erase_right("a"));
+    unordered_bimap<int, std::string> copy = b;
+    EXPECT_EQ(copy, b);
+    for (it = b.begin_left(); it != b.end_left();) {
+        it = b.erase_left(it);
+    }
+    EXPECT_TRUE(b.empty());
+    EXPECT_NE(copy, b);
+    EXPECT_EQ(copy.at_left(2), "b");
+}
+
+struct counting_hash {
+    std::size_t operator()(int x) const {
+        calls++;
+        return std::hash<int>()(x);
+    }
+
+    static inline int calls = 0;
+};
+
+TEST(unordered_bimap, erase_does_not_rehash) {
+    std::vector<std::tuple<int, int>> source;
+    for (int i = 0; i < 1000; i++) {
+        source.emplace_back(i, -i);
+    }
+    unordered_bimap<int, int, counting_hash, counting_hash> b(source.begin(), source.end());
+    EXPECT_EQ(b.size(), 1000);
+    EXPECT_EQ(b.at_left(10), -10);
+    counting_hash::calls = 0;
+    for (auto it = b.begin_left(); it != b.end_left();) {
+        it = *it % 3 ? b.erase_left(it) : std::next(it);
+    }
+    EXPECT_EQ(counting_hash::calls, 0);
+    EXPECT_EQ(b.size(), 334);
+    for (int i = 0; i < 1000; i++) {
+        EXPECT_EQ(b.find_left(i) != b.end_left(), i % 3 == 0);
+        EXPECT_EQ(b.find_right(-i) != b.end_right(), i % 3 == 0);
+    }
+}
+
+TEST(unordered_bimap, randomized_against_bimap) {
+    std::mt19937 e(1488228);
+    unordered_bimap<int, int> u;
+    bimap<int, int> b;
+    for (int i = 0; i < 100000; i++) {
+        int l = e() % 3000, r = e() % 3000;
+        switch (e() % 4) {
+        case 0:
+        case 1: {
+            auto it = u.insert(l, r);
+            ASSERT_EQ(it == u.end_left(), b.insert(l, r) == b.end_left());
+            break;
+        }
+        case 2:
+            ASSERT_EQ(u.erase_left(l), b.erase_left(l));
+            break;
+        default:
+            ASSERT_EQ(u.erase_right(r), b.erase_right(r));
+        }
+        ASSERT_EQ(u.size(), b.size());
+    }
+    for (auto it = b.begin_left(); it != b.end_left(); ++it) {
+        ASSERT_EQ(u.at_left(*it), *it.flip());
+        ASSERT_EQ(u.at_right(*it.flip()), *it);
+    }
+    size_t visited = 0;
+    for (auto it = u.begin_right(); it != u.end_right(); ++it, ++visited) {
+        ASSERT_EQ(b.at_right(*it), *it.flip());
+    }
+    EXPECT_EQ(visited, b.size());
+}
+
+TEST(compact_bimap, basic) {
+    compact_bimap<int, std::string> b;
+    b.insert(2, "b");
+    b.insert(1, "c");
+    auto it = b.insert(3, "a");
+    EXPECT_EQ(*it.flip(), "a");
+    it = b.insert(1, "d");
+    EXPECT_EQ(it, b.end_left());
+    EXPECT_EQ(b.size(), 3);
+    EXPECT_EQ(*b.begin_left(), 1);
+    EXPECT_EQ(*b.begin_right(), "a");
+    EXPECT_EQ(*--b.end_right(), "c");
+    EXPECT_EQ(*b.lower_bound_left(2).flip(), "b");
+    EXPECT_EQ(b.upper_bound_right("c"), b.end_right());
+    EXPECT_EQ(b.at_right("c"), 1);
+    EXPECT_THROW(b.at_left(4), std::out_of_range);
+    compact_bimap<int, std::string> copy = b;
+    EXPECT_EQ(*b.erase_left(b.begin_left()), 2);
+    EXPECT_FALSE(b.erase_left(1));
+    EXPECT_TRUE(b.erase_right("a"));
+    EXPECT_EQ(b.size(), 1);
+    EXPECT_NE(copy, b);
+    EXPECT_EQ(copy.at_left(1), "c");
+    compact_bimap<int, std::string> moved = std::move(copy);
+    EXPECT_TRUE(copy.empty());
+    EXPECT_EQ(moved.size(), 3);
+}
+
+TEST(compact_bimap, randomized_against_bimap) {
+    std::mt19937 e(1488228);
+    compact_bimap<int, int> c;
+    bimap<int, int> b;
+    for (int i = 0; i < 100000; i++) {
+        int l = e() % 3000, r = e() % 3000;
+        switch (e() % 5) {
+        case 0:
+        case 1: {
+            auto it = c.insert(l, r);
+            ASSERT_EQ(it == c.end_left(), b.insert(l, r) == b.end_left());
+            break;
+        }
+        case 2:
+            ASSERT_EQ(c.erase_left(l), b.erase_left(l));
+            break;
+        case 3:
+            ASSERT_EQ(c.erase_right(r), b.erase_right(r));
+            break;
+        default: {
+            auto it = c.lower_bound_right(r);
+            auto expected = b.lower_bound_right(r);
+            if (expected == b.end_right()) {
+                ASSERT_EQ(it, c.end_right());
+            } else {
+                ASSERT_EQ(*it, *expected);
+                auto next = c.erase_right(it);
+                auto expected_next = b.erase_right(expected);
+                ASSERT_EQ(next == c.end_right(), expected_next == b.end_right());
+                if (next != c.end_right()) {
+                    ASSERT_EQ(*next, *expected_next);
+                }
+            }
+        }
+        }
+        ASSERT_EQ(c.size(), b.size());
+    }
+    auto it = c.begin_left();
+    for (auto expected = b.begin_left(); expected != b.end_left(); ++expected, ++it) {
+        ASSERT_EQ(*it, *expected);
+        ASSERT_EQ(*it.flip(), *expected.flip());
+    }
+    EXPECT_EQ(it, c.end_left());
+    auto rit = c.end_right();
+    for (auto expected = b.end_right(); expected != b.begin_right();) {
+        ASSERT_EQ(*--rit, *--expected);
+    }
+    EXPECT_EQ(rit, c.begin_right());
+}
+
+TEST(frozen_bimap, basic) {
+    bimap<int, std::string> b;
+    b.insert(2, "b");
+    b.insert(1, "c");
+    b.insert(3, "a");
+    frozen_bimap<int, std::string> f(b);
+    EXPECT_EQ(f.size(), 3);
+    EXPECT_EQ(*f.begin_left(), 1);
+    EXPECT_EQ(*f.begin_right(), "a");
+    EXPECT_EQ(*--f.end_left(), 3);
+    EXPECT_EQ(f.at_left(1), "c");
+    EXPECT_EQ(f.at_right("a"), 3);
+    EXPECT_THROW(f.at_left(4), std::out_of_range);
+    EXPECT_EQ(f.find_right("d"), f.end_right());
+    EXPECT_EQ(*f.lower_bound_right("aa"), "b");
+    EXPECT_EQ(f.upper_bound_left(3), f.end_left());
+    EXPECT_EQ(*f.find_left(2).flip(), "b");
+    frozen_bimap<int, std::string> empty{bimap<int, std::string>()};
+    EXPECT_TRUE(empty.empty());
+    EXPECT_EQ(empty.begin_left(), empty.end_left());
+}
+
+TEST(frozen_bimap, keeps_comparators) {
+    struct directed_less {
+        bool descending = false;
+        bool operator()(int a, int b) const { return descending ? b < a : a < b; }
+    };
+    using map_t = bimap<int, int, directed_less, directed_less>;
+    map_t b(directed_less{true}, directed_less{false});
+    for (int i = 0; i < 100; i++) {
+        b.insert(i, (i * 37) % 101);
+    }
+    frozen_bimap<int, int, directed_less, directed_less> f(b);
+    EXPECT_EQ(*f.begin_left(), 99);
+    EXPECT_EQ(*f.begin_right(), 0);
+    EXPECT_TRUE(std::equal(f.begin_left(), f.end_left(), b.begin_left(), b.end_left()));
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(f.at_left(i), b.at_left(i));
+    }
+}
+
+TEST(frozen_bimap, randomized_against_bimap) {
+    std::mt19937 e(1488228);
+    for (int n : {1, 2, 7, 8, 100, 1023, 1024, 5000}) {
+        bimap<int, int> b;
+        while (b.size() < static_cast<size_t>(n)) {
+            b.insert(e() % (4 * n), e() % (4 * n));
+        }
+        frozen_bimap<int, int> f(b);
+        auto it = f.begin_left();
+        for (auto expected = b.begin_left(); expected != b.end_left(); ++expected, ++it) {
+            ASSERT_EQ(*it, *expected);
+            ASSERT_EQ(*it.flip(), *expected.flip());
+            ASSERT_EQ(*it.flip().flip(), *expected);
+        }
+        ASSERT_EQ(it, f.end_left());
+        auto rit = f.end_right();
+        for (auto expected = b.end_right(); expected != b.begin_right();) {
+            ASSERT_EQ(*--rit, *--expected);
+        }
+        ASSERT_EQ(rit, f.begin_right());
+        for (int key = -1; key <= 4 * n; key++) {
+            auto lower = b.lower_bound_right(key);
+            auto upper = b.upper_bound_left(key);
+            ASSERT_EQ(f.lower_bound_right(key) == f.end_right(), lower == b.end_right());
+            if (lower != b.end_right()) {
+                ASSERT_EQ(*f.lower_bound_right(key), *lower);
+            }
+            ASSERT_EQ(f.upper_bound_left(key) == f.end_left(), upper == b.end_left());
+            if (upper != b.end_left()) {
+                ASSERT_EQ(*f.upper_bound_left(key), *upper);
+            }
+            ASSERT_EQ(f.find_left(key) == f.end_left(), b.find_left(key) == b.end_left());
+        }
+    }
+}
+
+TEST(bimap, from_stream) {
+    std::vector<std::pair<int, int>> sorted{{1, 5}, {2, 4}, {2, 9}, {3, 4}, {4, 1}, {6, 0}};
+    std::vector<std::pair<int, int>> dropped;
+    auto on_duplicate = [&](int l, int r) { dropped.emplace_back(l, r); };
+    auto b = bimap<int, int>::from_stream(sorted.begin(), sorted.end(), true, on_duplicate);
+    EXPECT_EQ(b.size(), 4);
+    EXPECT_EQ(b.at_left(2), 4);
+    EXPECT_EQ(b.at_right(1), 4);
+    EXPECT_EQ(dropped, (std::vector<std::pair<int, int>>{{2, 9}, {3, 4}}));
+    bimap<int, int> expected;
+    for (auto const &p : sorted) {
+        expected.insert(p.first, p.second);
+    }
+    EXPECT_EQ(b, expected);
+
+    std::vector<std::pair<int, int>> shuffled{{4, 1}, {1, 5}, {6, 0}, {3, 4}, {2, 4}, {2, 9}};
+    auto unsorted = bimap<int, int>::from_stream(shuffled.begin(), shuffled.end());
+    EXPECT_EQ(unsorted, expected);
+    // A broken promise of sortedness falls back to sorting.
+    auto fallback = bimap<int, int>::from_stream(shuffled.begin(), shuffled.end(), true);
+    EXPECT_EQ(fallback, expected);
+    EXPECT_TRUE((bimap<int, int>::from_stream(sorted.end(), sorted.end(), true).empty()));
+}
+
+TEST(bimap_randomized, from_stream) {
+    std::mt19937 e(1488228);
+    for (int round = 0; round < 20; round++) {
+        std::vector<std::pair<int, int>> pairs;
+        for (int i = 0; i < 2000; i++) {
+            pairs.emplace_back(e() % 3000, e() % 3000);
+        }
+        bool sorted = round % 2 == 0;
+        if (sorted) {
+            std::stable_sort(pairs.begin(), pairs.end(),
+                             [](auto const &a, auto const &b) { return a.first < b.first; });
+        }
+        std::istringstream in([&] {
+            std::ostringstream out;
+            for (auto const &p : pairs) {
+                out << p.first << ' ' << p.second << ' ';
+            }
+            return out.str();
+        }());
+        struct pair_reader {
+            std::istream *in;
+            std::pair<int, int> value;
+            bool done;
+
+            using iterator_category = std::input_iterator_tag;
+            using value_type = std::pair<int, int>;
+            using difference_type = std::ptrdiff_t;
+            using pointer = std::pair<int, int> const *;
+            using reference = std::pair<int, int> const &;
+
+            reference operator*() const { return value; }
+            pair_reader &operator++() {
+                done = !(*in >> value.first >> value.second);
+                return *this;
+            }
+            bool operator!=(pair_reader const &other) const { return done != other.done; }
+        };
+        static_assert(std::is_same_v<std::iterator_traits<pair_reader>::iterator_category,
+                                     std::input_iterator_tag>);
+        pair_reader first{&in, {}, false};
+        ++first;
+        size_t dropped = 0;
+        auto b = bimap<int, int>::from_stream(first, pair_reader{&in, {}, true}, sorted,
+                                              [&](int, int) { dropped++; });
+        bimap<int, int> expected;
+        expected.assign(pairs.begin(), pairs.end());
+        ASSERT_EQ(b, expected);
+        ASSERT_EQ(dropped + b.size(), pairs.size());
+        b.insert(-1, -1);
+        ASSERT_EQ(*b.begin_left(), -1);
+    }
+}
+
+TEST(bimap, hinted_insert_and_find) {
+    bimap<int, int> b;
+    auto hint = b.end_left();
+    for (int i = 0; i < 100; i++) {
+        hint = b.insert(hint, i, -i);
+        EXPECT_EQ(*hint, i);
+        hint = b.end_left();
+    }
+    EXPECT_EQ(b.insert(b.begin_left(), 50, 1000), b.end_left());
+    EXPECT_EQ(b.insert(b.begin_left(), 1000, 0), b.end_left());
+    EXPECT_EQ(*b.insert(b.find_left(10), 1000, 1000), 1000);
+    EXPECT_EQ(*b.insert(b.find_left(90), -5, 5), -5);
+    EXPECT_EQ(*b.begin_left(), -5);
+    EXPECT_EQ(*b.find_left(b.find_left(3), 7).flip(), -7);
+    EXPECT_EQ(*b.find_left(b.end_left(), 0).flip(), 0);
+    EXPECT_EQ(b.find_left(b.begin_left(), 500), b.end_left());
+    EXPECT_EQ(b.find_left(b.find_left(60), -6), b.end_left());
+}
+
+struct recording_less {
+    bool operator()(int a, int b) const {
+        calls.emplace_back(a, b);
+        return a < b;
+    }
+
+    static inline std::vector<std::pair<int, int>> calls;
+};
+
+TEST(bimap, hinted_find_below_hint) {
+    bimap<int, int, recording_less> b;
+    for (int i = 0; i < 4096; i++) {
+        b.insert(i, i);
+    }
+    for (int key = 0; key < 4096; key += 7) {
+        recording_less::calls.clear();
+        b.find_left(key);
+        std::vector<int> path;
+        for (auto [x, y] : recording_less::calls) {
+            path.push_back(x == key ? y : x);
+        }
+        std::size_t full = path.size();
+        // Every node the plain search passes holds key in its subtree, so a
+        // search from it should only add the comparisons with the hint and
+        // with the one ancestor bounding its subtree.
+        for (std::size_t i = 1; i < full && path[i] != key; i++) {
+            if (path[i] == path[i - 1]) {
+                continue;
+            }
+            auto hint = b.find_left(path[i]);
+            recording_less::calls.clear();
+            EXPECT_EQ(*b.find_left(hint, key), key);
+            EXPECT_LE(recording_less::calls.size(), full - i + 3);
+        }
+    }
+}
+
+TEST(bimap_randomized, hinted_insert) {
+    std::mt19937 e(1488228);
+    bimap<int, int, std::less<int>, std::less<int>, std::allocator<std::pair<int, int>>, true> hinted;
+    bimap<int, int> plain;
+    auto hint = hinted.end_left();
+    for (int i = 0; i < 20000; i++) {
+        // Mostly ascending keys with some jumps back.
+        int l = e() % 8 ? i + static_cast<int>(e() % 16) : static_cast<int>(e() % 20000);
+        int r = static_cast<int>(e() % 40000);
+        auto it = hinted.insert(hint, l, r);
+        ASSERT_EQ(it == hinted.end_left(), plain.insert(l, r) == plain.end_left());
+        hint = it == hinted.end_left() ? hinted.find_left(hint, l) : it;
+        if (e() % 5 == 0) {
+            hint = e() % 2 ? hinted.begin_left() : hinted.end_left();
+        }
+    }
+    ASSERT_EQ(hinted.size(), plain.size());
+    size_t rank = 0;
+    for (auto it = plain.begin_left(); it != plain.end_left(); ++it, ++rank) {
+        auto found = hinted.find_left(hint, *it);
+        ASSERT_NE(found, hinted.end_left());
+        ASSERT_EQ(*found.flip(), *it.flip());
+        ASSERT_EQ(hinted.rank_left(*it), rank);
+        hint = found;
+    }
+    EXPECT_EQ(*hinted.begin_left(), *plain.begin_left());
+}
+
+TEST(bimap, ranges) {
+    bimap<int, std::string> b;
+    for (int i = 0; i < 10; i++) {
+        b.insert(i * 10, std::string(1, static_cast<char>('a' + i)));
+    }
+    std::vector<int> lefts;
+    for (int l : b.range_left(15, 50)) {
+        lefts.push_back(l);
+    }
+    EXPECT_EQ(lefts, (std::vector<int>{20, 30, 40}));
+    EXPECT_TRUE(b.range_left(41, 42).empty());
+    EXPECT_TRUE(b.range_left(50, 20).empty());
+    EXPECT_EQ(b.range_left(95, 1000).begin(), b.end_left());
+    auto window = b.range_left(0, 30);
+    window = b.range_left(window, 30, 60);
+    EXPECT_EQ(*window.begin(), 30);
+    EXPECT_EQ(*window.end(), 60);
+    window = b.range_left(window, 5, 15);
+    EXPECT_EQ(*window.begin(), 10);
+    EXPECT_EQ(*window.end(), 20);
+    std::string rights;
+    for (auto const &r : b.range_right("c", "f")) {
+        rights += r;
+    }
+    EXPECT_EQ(rights, "cde");
+    auto r_window = b.range_right(b.range_right("a", "b"), "i", "z");
+    EXPECT_EQ(*r_window.begin(), "i");
+    EXPECT_EQ(r_window.end(), b.end_right());
+}
+
+TEST(bimap, standard_algorithms) {
+    using map_t = bimap<int, std::string>;
+    static_assert(std::is_same_v<std::iterator_traits<map_t::left_iterator>::iterator_category,
+                                 std::bidirectional_iterator_tag>);
+    static_assert(std::is_same_v<std::iterator_traits<map_t::right_iterator>::value_type, std::string>);
+    static_assert(std::is_same_v<std::iterator_traits<compact_bimap<int, int>::right_iterator>::reference, int const&>);
+    static_assert(std::is_same_v<std::iterator_traits<unordered_bimap<int, int>::left_iterator>::iterator_category,
+                                 std::forward_iterator_tag>);
+    static_assert(std::is_nothrow_default_constructible_v<map_t::left_iterator>);
+    static_assert(std::is_nothrow_default_constructible_v<map_t::right_iterator>);
+    static_assert(std::is_nothrow_default_constructible_v<compact_bimap<int, int>::left_iterator>);
+    static_assert(std::is_nothrow_default_constructible_v<frozen_bimap<int, int>::right_iterator>);
+    static_assert(std::is_nothrow_default_constructible_v<unordered_bimap<int, int>::right_iterator>);
+#ifdef __cpp_lib_concepts
+    static_assert(std::bidirectional_iterator<map_t::left_iterator>);
+    static_assert(std::bidirectional_iterator<map_t::right_iterator>);
+    static_assert(std::bidirectional_iterator<compact_bimap<int, int>::left_iterator>);
+    static_assert(std::bidirectional_iterator<frozen_bimap<int, int>::right_iterator>);
+    static_assert(std::forward_iterator<unordered_bimap<int, int>::left_iterator>);
+#endif
+    map_t b;
+    for (int i = 0; i < 10; i++) {
+        b.insert(i * 10, std::string(1, static_cast<char>('j' - i)));
+    }
+    map_t::left_iterator singular;
+    singular = b.begin_left();
+    EXPECT_EQ(singular, b.begin_left());
+    EXPECT_EQ(std::distance(b.begin_left(), b.end_left()), 10);
+    EXPECT_EQ(*std::prev(b.end_left()), 90);
+    EXPECT_EQ(*std::next(b.begin_right(), 2), "c");
+    EXPECT_EQ(b.begin_right()->size(), 1u);
+    EXPECT_TRUE(std::is_sorted(b.begin_left(), b.end_left()));
+    EXPECT_EQ(std::count_if(b.begin_left(), b.end_left(), [](int l) { return l % 20 == 0; }), 5);
+    auto it = std::find_if(b.begin_left(), b.end_left(), [](int l) { return l > 35; });
+    EXPECT_EQ(*it, 40);
+    EXPECT_EQ(*it.flip(), "f");
+    EXPECT_EQ(*std::lower_bound(b.begin_left(), b.end_left(), 55), 60);
+    std::vector<int> reversed(std::make_reverse_iterator(b.end_left()), std::make_reverse_iterator(b.begin_left()));
+    EXPECT_EQ(reversed.front(), 90);
+    EXPECT_EQ(reversed.back(), 0);
+}
+
+TEST(bimap_randomized, sliding_ranges) {
+    std::mt19937 e(1488228);
+    bimap<int, int> b;
+    for (int i = 0; i < 5000; i++) {
+        b.insert(e() % 20000, e() % 20000);
+    }
+    auto window = b.range_right(0, 0);
+    int lo = 0;
+    for (int i = 0; i < 5000; i++) {
+        lo = e() % 4 ? lo + static_cast<int>(e() % 50) - 10 : static_cast<int>(e() % 21000) - 500;
+        int hi = lo + static_cast<int>(e() % 200) - 20;
+        auto fresh = b.range_right(lo, hi);
+        window = b.range_right(window, lo, hi);
+        auto first = b.lower_bound_right(lo);
+        auto last = hi < lo ? first : b.lower_bound_right(hi);
+        ASSERT_EQ(fresh.begin(), first);
+        ASSERT_EQ(fresh.end(), last);
+        ASSERT_EQ(window.begin(), first);
+        ASSERT_EQ(window.end(), last);
+        auto l_range = b.range_left(lo, hi);
+        ASSERT_EQ(l_range.begin(), b.lower_bound_left(lo));
+        ASSERT_EQ(l_range.end(), hi < lo ? b.lower_bound_left(lo) : b.lower_bound_left(hi));
+    }
+}
+
+TEST(bimap, save_and_load) {
+    std::mt19937 e(1488228);
+    bimap<int, double> b;
+    while (b.size() < 1000) {
+        b.insert(static_cast<int>(e() % 5000), static_cast<double>(e() % 5000) / 8);
+    }
+    std::string path = testing::TempDir() + "bimap_save_and_load";
+    b.save(path);
+    auto loaded = bimap<int, double>::load(path);
+    EXPECT_EQ(loaded, b);
+    loaded.insert(-1, -1);
+    EXPECT_EQ(loaded.at_right(-1), -1);
+    auto frozen = frozen_bimap<int, double>::load(path);
+    EXPECT_EQ(frozen.size(), b.size());
+    EXPECT_EQ(frozen.at_left(*b.begin_left()), *b.begin_left().flip());
+    mapped_bimap<int, double> mapped(path);
+    auto it = mapped.begin_right();
+    for (auto expected = b.begin_right(); expected != b.end_right(); ++expected, ++it) {
+        ASSERT_EQ(*it, *expected);
+        ASSERT_EQ(*it.flip(), *expected.flip());
+        ASSERT_EQ(*mapped.find_left(*expected.flip()).flip(), *expected);
+    }
+    EXPECT_EQ(it, mapped.end_right());
+    mapped.validate();
+    mapped_bimap<int, double> moved(std::move(mapped));
+    EXPECT_TRUE(mapped.empty());
+    EXPECT_EQ(moved.at_left(*b.begin_left()), *b.begin_left().flip());
+    mapped = std::move(moved);
+    EXPECT_EQ(mapped.size(), b.size());
+    EXPECT_TRUE(moved.empty());
+    EXPECT_EQ(*mapped.find_right(*b.begin_right()).flip(), *b.begin_right().flip());
+    EXPECT_THROW((mapped_bimap<int, int>(path)), std::runtime_error);
+    EXPECT_THROW((bimap<int, double>::load(path + ".missing")), std::runtime_error);
+    {
+        // Points a left cross index past the end.
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        frozen_layout layout(b.size(), sizeof(int), sizeof(double));
+        std::uint32_t bad = static_cast<std::uint32_t>(b.size()) + 7;
+        file.seekp(static_cast<std::streamoff>(layout.offsets[2]));
+        file.write(reinterpret_cast<char const *>(&bad), sizeof(bad));
+    }
+    EXPECT_THROW((bimap<int, double>::load(path)), std::runtime_error);
+    EXPECT_THROW((frozen_bimap<int, double>::load(path)), std::runtime_error);
+    EXPECT_THROW((mapped_bimap<int, double>(path).validate()), std::runtime_error);
+    b.save(path);
+    {
+        // Swaps two right cross indices, which keeps them in bounds.
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        frozen_layout layout(b.size(), sizeof(int), sizeof(double));
+        std::uint32_t cross[2];
+        file.seekg(static_cast<std::streamoff>(layout.offsets[3]));
+        file.read(reinterpret_cast<char *>(cross), sizeof(cross));
+        std::swap(cross[0], cross[1]);
+        file.seekp(static_cast<std::streamoff>(layout.offsets[3]));
+        file.write(reinterpret_cast<char const *>(cross), sizeof(cross));
+    }
+    EXPECT_THROW((bimap<int, double>::load(path)), std::runtime_error);
+    {
+        mapped_bimap<int, double> corrupted(path);
+        EXPECT_EQ(corrupted.size(), b.size());
+        EXPECT_THROW(corrupted.validate(), std::runtime_error);
+    }
+    bimap<int, double>().save(path);
+    EXPECT_TRUE((bimap<int, double>::load(path).empty()));
+    EXPECT_TRUE((mapped_bimap<int, double>(path).empty()));
+    std::remove(path.c_str());
+}
+
 template <typename T>
 std::vector<std::pair<T, T>>
 eliminate_same(std::vector<T> &lefts, std::vector<T> &rights, std::mt19937 &e) {
@@ -433,3 +1895,220 @@ TEST(bimap_randomized, compare_to_two_maps) {
     std::cout << "Performed " << ins << " insertions and " << total - ins - skip
               << " erasures. " << skip << " skipped." << std::endl;
 }
+
+TEST(bimap_randomized, insert_batch) {
+    std::mt19937 e(1488228);
+    for (int round = 0; round < 50; round++) {
+        counted_bimap b, expected;
+        if (round % 10 == 0) {
+            // Large enough for the batch to be located up front.
+            std::vector<std::pair<int, int>> base;
+            for (int i = 0; i < 70000; i++) {
+                base.emplace_back(1000 + i, 1000 + (i * 7) % 70000);
+            }
+            b.assign(base.begin(), base.end());
+            expected = b;
+        }
+        for (int step = 0; step < 5; step++) {
+            std::vector<std::pair<int, int>> batch(e() % 300);
+            for (auto &p : batch) {
+                p = {static_cast<int>(e() % 1000), static_cast<int>(e() % 1000)};
+            }
+            std::vector<bool> inserted = b.insert_batch(batch.begin(), batch.end());
+            ASSERT_EQ(inserted.size(), batch.size());
+            for (size_t i = 0; i < batch.size(); i++) {
+                ASSERT_EQ(inserted[i], expected.insert(batch[i].first, batch[i].second) != expected.end_left());
+            }
+            ASSERT_EQ(b, expected);
+            ASSERT_EQ(b.size(), expected.size());
+            for (size_t i = 0; i < std::min<size_t>(b.size(), 2000); i++) {
+                ASSERT_EQ(*b.nth_left(i), *expected.nth_left(i));
+                ASSERT_EQ(*b.nth_right(i), *expected.nth_right(i));
+            }
+            ASSERT_EQ(b.begin_right() == b.end_right(), expected.empty());
+        }
+    }
+}
+
+TEST(bimap_randomized, set_operations) {
+    std::mt19937 e(1488228);
+    for (int round = 0; round < 50; round++) {
+        counted_bimap a, b;
+        std::map<int, int> left_a, left_b;
+        for (int i = 0; i < 200; i++) {
+            int l = e() % 300, r = e() % 300;
+            if (a.insert(l, r) != a.end_left()) {
+                left_a[l] = r;
+            }
+            l = e() % 300;
+            r = e() % 300;
+            if (round % 3 == 0 ? b.insert(l, r) != b.end_left() : i % 20 == 0 && b.insert(l, r) != b.end_left()) {
+                left_b[l] = r;
+            }
+        }
+        std::map<int, int> both, only_a;
+        for (auto const &p : left_a) {
+            auto it = left_b.find(p.first);
+            (it != left_b.end() && it->second == p.second ? both : only_a).insert(p);
+        }
+        counted_bimap c = a;
+        c.intersect(b);
+        ASSERT_EQ(c, counted_bimap(both.begin(), both.end()));
+        c = b;
+        c.intersect(a);
+        ASSERT_EQ(c, counted_bimap(both.begin(), both.end()));
+        c = b;
+        c.difference(a);
+        ASSERT_EQ(c.size(), b.size() - both.size());
+        c = a;
+        c.difference(b);
+        ASSERT_EQ(c, counted_bimap(only_a.begin(), only_a.end()));
+        size_t i = 0;
+        for (auto it = c.begin_right(); it != c.end_right(); it++) {
+            ASSERT_EQ(c.rank_right(*it), i++);
+        }
+
+        auto d = diff(a, b);
+        size_t changed = 0, removed = 0;
+        for (auto const &p : left_a) {
+            auto it = left_b.find(p.first);
+            removed += it == left_b.end();
+            changed += it != left_b.end() && it->second != p.second;
+        }
+        ASSERT_EQ(d.removed.size(), removed);
+        ASSERT_EQ(d.changed.size(), changed);
+        ASSERT_EQ(d.added.size(), b.size() - (a.size() - removed));
+
+        counted_bimap merged = a, expected = a, rest;
+        for (auto it = b.begin_left(); it != b.end_left(); it++) {
+            if (expected.insert(*it, *it.flip()) == expected.end_left()) {
+                rest.insert(*it, *it.flip());
+            }
+        }
+        counted_bimap source = b;
+        merged.merge(std::move(source));
+        ASSERT_EQ(merged, expected);
+        ASSERT_EQ(source, rest);
+        for (size_t i = 0; i < merged.size(); i++) {
+            ASSERT_EQ(*merged.nth_right(i), *expected.nth_right(i));
+        }
+        for (size_t i = 0; i < source.size(); i++) {
+            ASSERT_EQ(*source.nth_right(i), *rest.nth_right(i));
+        }
+    }
+}
+
+TEST(bimap_randomized, split_and_join) {
+    std::mt19937 e(1488228);
+    for (int round = 0; round < 100; round++) {
+        counted_bimap b;
+        for (int i = 0; i < 300; i++) {
+            b.insert(e() % 1000, e() % 1000);
+        }
+        counted_bimap copy = b;
+        int key = e() % 1100;
+        bool by_left = e() % 2;
+        counted_bimap upper = by_left ? b.split_left(key) : b.split_right(key);
+        ASSERT_EQ(b.size() + upper.size(), copy.size());
+        size_t i = 0;
+        for (auto it = b.begin_left(); it != b.end_left(); it++, i++) {
+            ASSERT_EQ(by_left ? *it < key : *it.flip() < key, true);
+            ASSERT_EQ(copy.at_left(*it), *it.flip());
+            ASSERT_EQ(b.rank_left(*it), i);
+        }
+        ASSERT_EQ(i, b.size());
+        i = 0;
+        for (auto it = upper.begin_right(); it != upper.end_right(); it++, i++) {
+            ASSERT_EQ(by_left ? *it.flip() >= key : *it >= key, true);
+            ASSERT_EQ(copy.at_right(*it), *it.flip());
+            ASSERT_EQ(upper.rank_right(*it), i);
+        }
+        ASSERT_EQ(i, upper.size());
+        if (by_left) {
+            b.join(std::move(upper));
+        } else {
+            upper.merge(std::move(b));
+            b.swap(upper);
+        }
+        ASSERT_EQ(b, copy);
+        for (i = 0; i < b.size(); i++) {
+            ASSERT_EQ(*b.nth_right(i), *copy.nth_right(i));
+        }
+    }
+}
+
+TEST(bimap_randomized, join_interleaved) {
+    // Every right key of upper falls between two of b, so the right trees
+    // are united all the way down.
+    const int n = 200000;
+    counted_bimap b, upper;
+    std::vector<std::pair<int, int>> lower_pairs, upper_pairs;
+    for (int i = 0; i < n; i++) {
+        (i < n / 2 ? lower_pairs : upper_pairs).emplace_back(i, i < n / 2 ? 2 * i : 2 * (i - n / 2) + 1);
+    }
+    b.assign(lower_pairs.begin(), lower_pairs.end(), true);
+    upper.assign(upper_pairs.begin(), upper_pairs.end(), true);
+    b.join(std::move(upper));
+    ASSERT_EQ(b.size(), n);
+    int expected = 0;
+    for (auto it = b.begin_right(); it != b.end_right(); it++, expected++) {
+        ASSERT_EQ(*it, expected);
+    }
+    ASSERT_EQ(expected, n);
+    std::mt19937 e(1488228);
+    for (int i = 0; i < 1000; i++) {
+        int k = e() % n;
+        ASSERT_EQ(*b.nth_right(k), k);
+        ASSERT_EQ(b.rank_right(k), static_cast<size_t>(k));
+        ASSERT_EQ(b.at_right(k), k % 2 ? n / 2 + k / 2 : k / 2);
+    }
+}
+
+TEST(bimap_randomized, erase_ranges) {
+    std::mt19937 e(seed);
+    for (int round = 0; round < 500; round++) {
+        bimap<int, int> b;
+        std::map<int, int> left_view, right_view;
+        for (int i = 0; i < 40; i++) {
+            int l = e() % 100, r = e() % 100;
+            if (b.insert(l, r) != b.end_left()) {
+                left_view[l] = r;
+                right_view[r] = l;
+            }
+        }
+        for (int k = 0; k < 3; k++) {
+            int lo = e() % 110, hi = e() % 110;
+            if (lo > hi) {
+                std::swap(lo, hi);
+            }
+            if (e() % 2) {
+                b.erase_left(b.lower_bound_left(lo), b.lower_bound_left(hi));
+                auto it = left_view.lower_bound(lo);
+                for (; it != left_view.end() && it->first < hi;) {
+                    right_view.erase(it->second);
+                    it = left_view.erase(it);
+                }
+            } else {
+                b.erase_right(b.lower_bound_right(lo), b.lower_bound_right(hi));
+                auto it = right_view.lower_bound(lo);
+                for (; it != right_view.end() && it->first < hi;) {
+                    left_view.erase(it->second);
+                    it = right_view.erase(it);
+                }
+            }
+            ASSERT_EQ(b.size(), left_view.size());
+            auto lit = b.begin_left();
+            for (auto const &p : left_view) {
+                EXPECT_EQ(*lit, p.first);
+                EXPECT_EQ(*lit.flip(), p.second);
+                lit++;
+            }
+            EXPECT_EQ(lit, b.end_left());
+            auto rit = b.begin_right();
+            for (auto const &p : right_view) {
+                EXPECT_EQ(*rit++, p.first);
+            }
+            EXPECT_EQ(rit, b.end_right());
+        }
+    }
+}